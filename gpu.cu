@@ -0,0 +1,172 @@
+// 可选的GPU后端：直接求和的引力核与位置更新（main_gpu目标）
+//
+// 同一份源码既可以用nvcc编译成CUDA，也可以当作HIP源码用hipcc/clang编译，
+// 运行时API通过下面几个宏对应起来。与main.cpp之间只通过gpu命名空间里的几个函数交互，
+// main.cpp中有对应的声明；星体数据按Stars的布局传递：七个数组依次连续，每个padded个float。
+
+#if defined(__HIPCC__) || defined(__HIP__)
+#include <hip/hip_runtime.h>
+#define cudaDeviceProp hipDeviceProp_t
+#define cudaDeviceSynchronize hipDeviceSynchronize
+#define cudaError_t hipError_t
+#define cudaFree hipFree
+#define cudaGetDeviceCount hipGetDeviceCount
+#define cudaGetDeviceProperties hipGetDeviceProperties
+#define cudaGetErrorString hipGetErrorString
+#define cudaGetLastError hipGetLastError
+#define cudaMalloc hipMalloc
+#define cudaMemcpy hipMemcpy
+#define cudaMemcpyDeviceToHost hipMemcpyDeviceToHost
+#define cudaMemcpyHostToDevice hipMemcpyHostToDevice
+#define cudaSuccess hipSuccess
+#else
+#include <cuda_runtime.h>
+#endif
+
+#include <cstddef>
+#include <cstdio>
+
+namespace gpu {
+
+/**
+ * @brief 由main.cpp传入的常数，与CPU核使用的G_dt、dt、eps_sqr相同
+ */
+struct Params {
+  float g_dt, dt, eps_sqr;
+};
+
+constexpr int BLOCK = 256; // 每个线程块的线程数，也是共享内存中一个j块的星体数
+constexpr int NUM_ARRAYS = 7;
+
+/**
+ * @brief 按值传给核函数的参数：星体数与七个数组在显存中的地址
+ */
+struct View {
+  std::size_t n, padded;
+  Params params;
+  float *px, *py, *pz, *vx, *vy, *vz, *mass;
+};
+
+struct Device {
+  View view;
+  float *data; // 显存中的七个数组，布局与Stars相同
+  cudaDeviceProp prop;
+};
+
+namespace {
+
+bool check(cudaError_t err, const char *what) {
+  if (err == cudaSuccess)
+    return true;
+  std::fprintf(stderr, "gpu: %s: %s\n", what, cudaGetErrorString(err));
+  return false;
+}
+
+/**
+ * @brief 每个线程负责一个i，线程块协作把BLOCK个j的(px, py, pz, m)读进共享内存
+ *
+ * 一个j块被块内所有线程复用，全局内存的读取量降到1/BLOCK。
+ * 补齐的幽灵j质量为0，j块超出padded的部分填0，都不贡献引力；fast-math下rsqrtf是一条指令。
+ */
+__global__ void force_kernel(View d) {
+  __shared__ float4 tile[BLOCK];
+  const std::size_t i = (std::size_t)blockIdx.x * BLOCK + threadIdx.x;
+  const float pxi = i < d.n ? d.px[i] : 0.0f;
+  const float pyi = i < d.n ? d.py[i] : 0.0f;
+  const float pzi = i < d.n ? d.pz[i] : 0.0f;
+  float ax = 0.0f, ay = 0.0f, az = 0.0f;
+  for (std::size_t j0 = 0; j0 < d.padded; j0 += BLOCK) {
+    const std::size_t j = j0 + threadIdx.x;
+    tile[threadIdx.x] = j < d.padded ? make_float4(d.px[j], d.py[j], d.pz[j], d.mass[j])
+                                     : make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+    __syncthreads();
+#pragma unroll 16
+    for (int k = 0; k < BLOCK; k++) {
+      const float4 q = tile[k];
+      float dx = q.x - pxi, dy = q.y - pyi, dz = q.z - pzi;
+      float r = rsqrtf(dx * dx + dy * dy + dz * dz + d.params.eps_sqr);
+      float f = q.w * r * r * r;
+      ax += dx * f;
+      ay += dy * f;
+      az += dz * f;
+    }
+    __syncthreads();
+  }
+  if (i < d.n) {
+    d.vx[i] += d.params.g_dt * ax;
+    d.vy[i] += d.params.g_dt * ay;
+    d.vz[i] += d.params.g_dt * az;
+  }
+}
+
+/**
+ * @brief 位置更新必须等所有线程块的引力都算完，因此是单独的一次核启动
+ */
+__global__ void drift_kernel(View d) {
+  const std::size_t i = (std::size_t)blockIdx.x * BLOCK + threadIdx.x;
+  if (i < d.padded) {
+    d.px[i] += d.vx[i] * d.params.dt;
+    d.py[i] += d.vy[i] * d.params.dt;
+    d.pz[i] += d.vz[i] * d.params.dt;
+  }
+}
+
+} // namespace
+
+/**
+ * @brief 在第0块GPU上分配显存，没有可用的设备时返回nullptr
+ */
+Device *open(std::size_t n, std::size_t padded, Params params) {
+  int count = 0;
+  if (!check(cudaGetDeviceCount(&count), "cudaGetDeviceCount") || count == 0)
+    return nullptr;
+  Device *d = new Device{};
+  d->view.n = n;
+  d->view.padded = padded;
+  d->view.params = params;
+  if (!check(cudaGetDeviceProperties(&d->prop, 0), "cudaGetDeviceProperties") ||
+      !check(cudaMalloc(&d->data, NUM_ARRAYS * padded * sizeof(float)), "cudaMalloc")) {
+    delete d;
+    return nullptr;
+  }
+  View &v = d->view;
+  float **arrays[NUM_ARRAYS] = {&v.px, &v.py, &v.pz, &v.vx, &v.vy, &v.vz, &v.mass};
+  for (int a = 0; a < NUM_ARRAYS; a++)
+    *arrays[a] = d->data + a * padded;
+  return d;
+}
+
+const char *name(Device const *d) { return d->prop.name; }
+
+void upload(Device *d, const float *host) {
+  const std::size_t bytes = NUM_ARRAYS * d->view.padded * sizeof(float);
+  check(cudaMemcpy(d->data, host, bytes, cudaMemcpyHostToDevice), "upload");
+}
+
+void download(Device *d, float *host) {
+  const std::size_t bytes = NUM_ARRAYS * d->view.padded * sizeof(float);
+  check(cudaMemcpy(host, d->data, bytes, cudaMemcpyDeviceToHost), "download");
+}
+
+/**
+ * @brief 连续推进steps步，期间数据一直留在显存里
+ *
+ * 核启动是异步的，同一个流里按顺序执行，只在最后同步一次。
+ */
+void run(Device *d, long steps) {
+  const unsigned blocks = (unsigned)((d->view.padded + BLOCK - 1) / BLOCK);
+  for (long s = 0; s < steps; s++) {
+    force_kernel<<<blocks, BLOCK>>>(d->view);
+    drift_kernel<<<blocks, BLOCK>>>(d->view);
+  }
+  check(cudaGetLastError(), "kernel launch");
+  check(cudaDeviceSynchronize(), "cudaDeviceSynchronize");
+}
+
+void close(Device *d) {
+  if (d)
+    cudaFree(d->data);
+  delete d;
+}
+
+} // namespace gpu
@@ -0,0 +1,77 @@
+// 按微架构级别分派的启动器（HW04_MICROARCH=ON时构建为main-auto和main_mt-auto）
+//
+// 每个级别的二进制<base>-x86-64-v2/v3/v4与启动器安装在同一目录；启动器检测CPU支持的最高级别，
+// 在自己所在的目录里找到对应的二进制并exec，参数和环境原样传递，因此对调用者透明。
+// HW04_LAUNCH_LEVEL=v2|v3|v4强制指定级别；HW04_LAUNCH_VERBOSE=1时在stderr打印选中的路径。
+// 三个级别上SIMD核仍然由main.cpp运行时分派，级别只决定其余代码（标量路径、树、积分器等）的指令集。
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+
+#ifndef HW04_LAUNCH_BASE
+#define HW04_LAUNCH_BASE "main"
+#endif
+
+namespace {
+
+const char *const LEVELS[] = {"x86-64-v2", "x86-64-v3", "x86-64-v4"};
+
+/**
+ * @brief CPU（以及操作系统保存的寄存器状态）支持的最高级别，0..2对应v2..v4，都不支持时返回-1
+ */
+int detect_level() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("x86-64-v4"))
+    return 2;
+  if (__builtin_cpu_supports("x86-64-v3"))
+    return 1;
+  if (__builtin_cpu_supports("x86-64-v2"))
+    return 0;
+  return -1;
+}
+
+/**
+ * @brief 启动器自身所在的目录（含结尾的'/'）
+ */
+std::string self_dir() {
+  char buf[4096];
+  ssize_t len = readlink("/proc/self/exe", buf, sizeof buf - 1);
+  if (len <= 0)
+    return "./";
+  std::string path(buf, (std::size_t)len);
+  return path.substr(0, path.rfind('/') + 1);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  (void)argc;
+  int level = detect_level();
+  if (const char *env = std::getenv("HW04_LAUNCH_LEVEL")) {
+    if (std::strcmp(env, "v2") == 0)
+      level = 0;
+    else if (std::strcmp(env, "v3") == 0)
+      level = 1;
+    else if (std::strcmp(env, "v4") == 0)
+      level = 2;
+    else {
+      std::fprintf(stderr, "launcher: unknown HW04_LAUNCH_LEVEL=%s (v2, v3 or v4)\n", env);
+      return 1;
+    }
+  }
+  if (level < 0) {
+    std::fprintf(stderr, "launcher: this CPU does not support x86-64-v2\n");
+    return 1;
+  }
+  const std::string path = self_dir() + HW04_LAUNCH_BASE "-" + LEVELS[level];
+  const char *verbose = std::getenv("HW04_LAUNCH_VERBOSE");
+  if (verbose && std::strcmp(verbose, "0") != 0)
+    std::fprintf(stderr, "launcher: %s\n", path.c_str());
+  execv(path.c_str(), argv);
+  std::perror(("launcher: " + path).c_str());
+  return 127;
+}
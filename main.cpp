@@ -33,21 +33,80 @@
 - 最终提交时需要包含详细的性能分析报告
 */
 
-#include <array>
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <cmath>
 #include <cstdio>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <immintrin.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
 #include <vector>
 
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HW04_PERF
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef HW04_MT
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef HW04_MPI
+#include <mpi.h>
+#endif
+
+/**
+ * @brief frand()的状态：最近一次播种的种子与之后的抽取次数
+ *
+ * rand()的内部状态不可读，检查点只保存这两个数，恢复时重新播种并丢弃同样多次抽取。
+ */
+struct RngState {
+  std::uint64_t seed = 1; // 没有调用srand时rand()的种子为1
+  std::uint64_t draws = 0;
+};
+RngState rng_state;
+
+void rng_seed(unsigned seed) {
+  std::srand(seed);
+  rng_state = {seed, 0};
+}
+
+void rng_restore(RngState s) {
+  std::srand((unsigned)s.seed);
+  for (std::uint64_t k = 0; k < s.draws; k++)
+    std::rand();
+  rng_state = s;
+}
+
 float frand() {
+  rng_state.draws++;
   return (float)std::rand() / (float)RAND_MAX * 2.0f - 1.0f;
 } // 这个函数应该没有什么可以优化的地方
 
 // SOA (Structure of Arrays) - 已成功应用的优化技术
 // ✅ 优化1：将相同属性的数据连续存储，提高SIMD向量化效率和缓存命中率
-// ✅ 优化2：使用std::array替代std::vector，消除动态内存分配开销
-// ✅ 优化3：固定大小、栈分配、无动态内存开销、编译时优化
+// ✅ 优化2：所有数组从同一块64字节对齐的arena中切分，只有一次动态分配
+// ✅ 优化3：长度补齐到SIMD宽度的整数倍，补齐部分是质量为0的"幽灵星体"，内层循环没有尾部处理
 // ✅ 优化4：连续内存访问模式，便于CPU预取和缓存利用
 
 /*
@@ -55,13 +114,156 @@ float frand() {
 ❌ 预取指令：现代CPU硬件预取已足够智能，手动预取效果不佳
 ❌ 其他复杂内存优化：当前访问模式已优化，过度优化可能适得其反
 */
-constexpr std::size_t NUM = 48;
+constexpr std::size_t DEFAULT_NUM = 48; // 作业默认的星体数量
+constexpr long NUM_STEPS = 100000;      // 作业规定的时间步数
+constexpr std::size_t SIMD_WIDTH = 16;  // 一条64字节缓存行 = 一个AVX-512寄存器 = 16个float
+constexpr std::size_t CACHE_LINE = 64;
+
+/**
+ * @brief 64字节对齐的线性内存池
+ *
+ * 构造时一次性分配并清零，之后用take()顺序切出对齐的float数组。
+ * 不支持单独释放，整块内存随Arena一起释放。
+ */
+class Arena {
+public:
+  Arena() = default;
+  explicit Arena(std::size_t bytes) : size_(round_up(bytes, CACHE_LINE)) {
+    if (size_ == 0)
+      return;
+    base_.reset(static_cast<unsigned char *>(std::aligned_alloc(CACHE_LINE, size_)));
+    if (!base_)
+      throw std::bad_alloc();
+    std::memset(base_.get(), 0, size_);
+  }
+
+  float *take(std::size_t count) {
+    std::size_t bytes = round_up(count * sizeof(float), CACHE_LINE);
+    if (used_ + bytes > size_)
+      throw std::bad_alloc();
+    float *p = reinterpret_cast<float *>(base_.get() + used_);
+    used_ += bytes;
+    return p;
+  }
+
+  static constexpr std::size_t round_up(std::size_t x, std::size_t a) {
+    return (x + a - 1) / a * a;
+  }
+
+private:
+  struct Free {
+    void operator()(unsigned char *p) const { std::free(p); }
+  };
+  std::unique_ptr<unsigned char, Free> base_;
+  std::size_t size_ = 0;
+  std::size_t used_ = 0;
+};
+
+/**
+ * @brief 线程私有的64字节对齐临时数组，容量只增不减，稳态下每步没有内存分配
+ *
+ * 内容不保证清零；同一线程内后一次调用会覆盖前一次返回的数组。
+ */
+float *scratch(std::size_t count) {
+  thread_local Arena arena;
+  thread_local float *buf = nullptr;
+  thread_local std::size_t cap = 0;
+  if (count > cap) {
+    cap = Arena::round_up(count, SIMD_WIDTH);
+    arena = Arena(cap * sizeof(float));
+    buf = arena.take(cap);
+  }
+  return buf;
+}
+
+/**
+ * @brief 运行时大小的SOA星体容器
+ *
+ * n是真实星体数量，padded是补齐到SIMD_WIDTH倍数后的数组长度。
+ * [n, padded)之间是质量、位置、速度都为0的幽灵星体：它们对别的星体的引力恰好为0，
+ * 因此内层j循环可以直接跑到padded，不需要尾部循环。
+ * 七个数组都从同一个arena中切出，每个数组都是64字节对齐的。
+ */
 struct Stars {
-  alignas(64) std::array<float, NUM> px, py, pz; // 所有星体的x,y,z坐标分别连续存储，64字节对齐
-  alignas(64) std::array<float, NUM> vx, vy, vz; // 所有星体的x,y,z速度分别连续存储，64字节对齐
-  alignas(64) std::array<float, NUM> mass;       // 所有星体的质量连续存储，64字节对齐
+  static constexpr std::size_t NUM_ARRAYS = 7;
+
+  std::size_t n = 0;
+  std::size_t padded = 0;
+  float *px = nullptr, *py = nullptr, *pz = nullptr; // 所有星体的x,y,z坐标分别连续存储，64字节对齐
+  float *vx = nullptr, *vy = nullptr, *vz = nullptr; // 所有星体的x,y,z速度分别连续存储，64字节对齐
+  float *mass = nullptr;                           // 所有星体的质量连续存储，64字节对齐
+
+  explicit Stars(std::size_t count)
+      : n(count), padded(Arena::round_up(count, SIMD_WIDTH)),
+        arena_(NUM_ARRAYS * padded * sizeof(float)) {
+    px = arena_.take(padded);
+    py = arena_.take(padded);
+    pz = arena_.take(padded);
+    vx = arena_.take(padded);
+    vy = arena_.take(padded);
+    vz = arena_.take(padded);
+    mass = arena_.take(padded);
+  }
+
+  /**
+   * @brief 不分配内存：七个数组依次指向base开始、每个padded个float的区域
+   *
+   * mapping持有这块内存（例如检查点文件的映射），随Stars一起释放。
+   */
+  Stars(std::size_t count, float *base, std::shared_ptr<void> mapping)
+      : n(count), padded(Arena::round_up(count, SIMD_WIDTH)), mapping_(std::move(mapping)) {
+    float **arrays[NUM_ARRAYS] = {&px, &py, &pz, &vx, &vy, &vz, &mass};
+    for (std::size_t a = 0; a < NUM_ARRAYS; a++)
+      *arrays[a] = base + a * padded;
+  }
+
+  Stars(Stars &&) = default;
+  Stars &operator=(Stars &&) = default;
+  Stars(Stars const &) = delete;
+  Stars &operator=(Stars const &) = delete;
+
+private:
+  Arena arena_;
+  std::shared_ptr<void> mapping_;
+};
+
+/**
+ * @brief 批量系综：M个互相独立、各有bodies个星体的小系统
+ *
+ * 交错的SOA布局：px[body * lanes + system]，同一个星体在不同系统中的数据连续存放，
+ * 一个SIMD向量的每个lane就是一个系统，计算时不需要水平求和。
+ * lanes是系统数补齐到SIMD_WIDTH的倍数，补齐的系统质量为0，不影响任何结果。
+ */
+struct Ensemble {
+  static constexpr std::size_t NUM_ARRAYS = 7;
+
+  std::size_t bodies = 0;
+  std::size_t systems = 0;
+  std::size_t lanes = 0;
+  float *px = nullptr, *py = nullptr, *pz = nullptr;
+  float *vx = nullptr, *vy = nullptr, *vz = nullptr;
+  float *mass = nullptr;
+
+  Ensemble(std::size_t bodies_, std::size_t systems_)
+      : bodies(bodies_), systems(systems_), lanes(Arena::round_up(systems_, SIMD_WIDTH)),
+        arena_(NUM_ARRAYS * bodies_ * lanes * sizeof(float)) {
+    px = arena_.take(bodies * lanes);
+    py = arena_.take(bodies * lanes);
+    pz = arena_.take(bodies * lanes);
+    vx = arena_.take(bodies * lanes);
+    vy = arena_.take(bodies * lanes);
+    vz = arena_.take(bodies * lanes);
+    mass = arena_.take(bodies * lanes);
+  }
+
+  Ensemble(Ensemble &&) = default;
+  Ensemble &operator=(Ensemble &&) = default;
+  Ensemble(Ensemble const &) = delete;
+  Ensemble &operator=(Ensemble const &) = delete;
+
+private:
+  Arena arena_;
 };
-Stars stars;
 
 /*
   1. 可以使用#pragma omp simd
@@ -69,16 +271,32 @@ Stars stars;
   2. 小循环体可以使用#pragma
   unroll，因为stars的大小是确定的，为48，刚好是2的N次方，我打算设定展开因子为4
 */
+namespace defaults {
 constexpr float G = 0.001f;
 constexpr float eps = 0.001f;
 constexpr float dt = 0.01f;
 constexpr float eps_sqr = eps * eps;
 constexpr float G_dt = G * dt;
+} // namespace defaults
+
+// 运行参数：默认值与作业相同，main开始时由load_params()按--G/--eps/--dt设置一次，之后只读
+float G = defaults::G;
+float eps = defaults::eps;
+float dt = defaults::dt;
+float eps_sqr = defaults::eps_sqr;
+float G_dt = defaults::G_dt;
+
+/**
+ * @brief 参数是否都等于编译期默认值；是时N固定的特化核可以把它们当作常量折叠进代码
+ */
+inline bool default_params() {
+  return G == defaults::G && eps == defaults::eps && dt == defaults::dt;
+}
 
-void init() {
-  // std::array不需要动态分配内存，大小在编译时已确定
-  // 初始化每个星体的数据
-  for (std::size_t i = 0; i < NUM; ++i) {
+void init(Stars &stars) {
+  // arena已清零，幽灵星体[n, padded)的位置、速度、质量都保持为0
+  // 初始化每个真实星体的数据，顺序与原版一致，保证同一个种子得到相同的初始状态
+  for (std::size_t i = 0; i < stars.n; ++i) {
     stars.px[i] = frand();
     stars.py[i] = frand();
     stars.pz[i] = frand();
@@ -89,6 +307,428 @@ void init() {
   }
 }
 
+/**
+ * @brief 第s个系统用rng_seed(1 + s)播种后调用init()，
+ * 因此0号系统与单系统运行（默认种子为1）的初始状态完全相同
+ */
+void init(Ensemble &ens) {
+  Stars one(ens.bodies);
+  for (std::size_t s = 0; s < ens.systems; s++) {
+    rng_seed((unsigned)(1 + s));
+    std::memset(one.px, 0, Stars::NUM_ARRAYS * one.padded * sizeof(float));
+    init(one);
+    for (std::size_t i = 0; i < ens.bodies; i++) {
+      std::size_t k = i * ens.lanes + s;
+      ens.px[k] = one.px[i];
+      ens.py[k] = one.py[i];
+      ens.pz[k] = one.pz[i];
+      ens.vx[k] = one.vx[i];
+      ens.vy[k] = one.vy[i];
+      ens.vz[k] = one.vz[i];
+      ens.mass[k] = one.mass[i];
+    }
+  }
+}
+
+/*
+✅ 基于计数器的并行初始化（HW04_INIT=uniform|cube|plummer，HW04_SEED=种子）：
+
+ * init()依赖std::rand()：只能串行、glibc上每次调用都要加锁、不同平台的输出不同，
+   默认仍用它，保证作业的初始状态与结果不变
+ * Philox4x32-10：随机数只是(星体编号, 流编号, 尝试次数)与种子的函数，没有需要传递的状态，
+   任意一段星体都可以独立生成，结果与线程数、分段方式、平台都无关（只用整数运算和IEEE float）
+ * 每SIMD_WIDTH个星体一批，批内的每个lane互不依赖，编译器可以把32x32->64位乘法向量化
+ * main_mt中按段交给线程池；Plummer球最后的质心修正按编号顺序串行求和，同样与线程数无关
+ * uniform：与init()相同的分布（位置、速度在[-1, 1)，质量在[1, 2)）
+ * cube：位置在[-1, 1)³内均匀分布，速度为0（冷塌缩），质量为1
+ * plummer：尺度a = 1、每个星体质量为1的Plummer球，速度按分布函数用拒绝采样（Aarseth, Hénon, Wielen 1974）
+*/
+enum class InitKind { Rand, Uniform, Cube, Plummer };
+
+const char *init_kind_name(InitKind k) {
+  switch (k) {
+  case InitKind::Rand: return "rand";
+  case InitKind::Uniform: return "uniform";
+  case InitKind::Cube: return "cube";
+  case InitKind::Plummer: return "plummer";
+  }
+  return "?";
+}
+
+/**
+ * @brief 默认Rand即原来的init()，环境变量HW04_INIT=uniform|cube|plummer切换
+ */
+InitKind detect_init_kind() {
+  if (const char *env = std::getenv("HW04_INIT"))
+    for (InitKind k : {InitKind::Rand, InitKind::Uniform, InitKind::Cube, InitKind::Plummer})
+      if (std::strcmp(env, init_kind_name(k)) == 0)
+        return k;
+  return InitKind::Rand;
+}
+
+/**
+ * @brief Philox4x32-10：计数器c与密钥(k0, k1)经过10轮得到4个独立的32位随机数，结果写回c
+ */
+inline void philox(std::uint32_t c[4], std::uint32_t k0, std::uint32_t k1) {
+  for (int r = 0; r < 10; r++) {
+    std::uint64_t p0 = (std::uint64_t)0xD2511F53u * c[0];
+    std::uint64_t p1 = (std::uint64_t)0xCD9E8D57u * c[2];
+    std::uint32_t o0 = (std::uint32_t)(p1 >> 32) ^ c[1] ^ k0;
+    std::uint32_t o2 = (std::uint32_t)(p0 >> 32) ^ c[3] ^ k1;
+    c[1] = (std::uint32_t)p1;
+    c[3] = (std::uint32_t)p0;
+    c[0] = o0;
+    c[2] = o2;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+}
+
+/**
+ * @brief 32位随机数映射到[0, 1)，取高24位，恰好是float能精确表示的
+ */
+inline float u01(std::uint32_t x) { return (float)(x >> 8) * (1.0f / 16777216.0f); }
+
+/**
+ * @brief 星体i在流stream上的第attempt组4个随机数，映射到[0, 1)
+ */
+inline void random4(std::uint64_t seed, std::size_t i, std::uint32_t stream,
+                    std::uint32_t attempt, float out[4]) {
+  std::uint32_t c[4] = {(std::uint32_t)i, (std::uint32_t)((std::uint64_t)i >> 32), stream,
+                        attempt};
+  philox(c, (std::uint32_t)seed, (std::uint32_t)(seed >> 32));
+  for (int k = 0; k < 4; k++)
+    out[k] = u01(c[k]);
+}
+
+/**
+ * @brief 给[b, e)的真实星体生成初始状态；b须是SIMD_WIDTH的倍数，不同的段可以并行
+ */
+void init_range(Stars &s, InitKind kind, std::uint64_t seed, std::size_t b, std::size_t e) {
+  e = std::min(e, s.n);
+  for (std::size_t i0 = b; i0 < e; i0 += SIMD_WIDTH) {
+    const std::size_t len = std::min(SIMD_WIDTH, e - i0);
+    // 批内各lane互不依赖，流0、流1各给每个星体4个随机数
+    float r0[SIMD_WIDTH][4], r1[SIMD_WIDTH][4];
+    for (std::size_t l = 0; l < SIMD_WIDTH; l++) {
+      random4(seed, i0 + l, 0, 0, r0[l]);
+      random4(seed, i0 + l, 1, 0, r1[l]);
+    }
+    for (std::size_t l = 0; l < len; l++) {
+      const std::size_t i = i0 + l;
+      switch (kind) {
+      case InitKind::Rand:
+      case InitKind::Uniform:
+        s.px[i] = 2.0f * r0[l][0] - 1.0f;
+        s.py[i] = 2.0f * r0[l][1] - 1.0f;
+        s.pz[i] = 2.0f * r0[l][2] - 1.0f;
+        s.vx[i] = 2.0f * r0[l][3] - 1.0f;
+        s.vy[i] = 2.0f * r1[l][0] - 1.0f;
+        s.vz[i] = 2.0f * r1[l][1] - 1.0f;
+        s.mass[i] = r1[l][2] + 1.0f;
+        break;
+      case InitKind::Cube:
+        s.px[i] = 2.0f * r0[l][0] - 1.0f;
+        s.py[i] = 2.0f * r0[l][1] - 1.0f;
+        s.pz[i] = 2.0f * r0[l][2] - 1.0f;
+        s.vx[i] = s.vy[i] = s.vz[i] = 0.0f;
+        s.mass[i] = 1.0f;
+        break;
+      case InitKind::Plummer: {
+        const float total = (float)s.n, pi2 = 6.28318530718f;
+        // 质量分数X = r³ / (1 + r²)^(3/2)，反解r；X限制在0.999以内，避免半径无穷大
+        float x = std::max(r0[l][0] * 0.999f, 1e-7f);
+        float r = 1.0f / std::sqrt(std::pow(x, -2.0f / 3.0f) - 1.0f);
+        float cz = 2.0f * r0[l][1] - 1.0f, sz = std::sqrt(1.0f - cz * cz), phi = pi2 * r0[l][2];
+        s.px[i] = r * sz * std::cos(phi);
+        s.py[i] = r * sz * std::sin(phi);
+        s.pz[i] = r * cz;
+        // g(q) = q²(1 - q²)^(7/2)的最大值小于0.1，拒绝采样
+        float q = 0.0f;
+        for (std::uint32_t attempt = 0;; attempt++) {
+          float u[4];
+          random4(seed, i, 2, attempt, u);
+          float t = 1.0f - u[0] * u[0];
+          if (0.1f * u[1] < u[0] * u[0] * t * t * t * std::sqrt(t)) {
+            q = u[0];
+            break;
+          }
+        }
+        float v = q * std::sqrt(2.0f * G * total) * std::pow(1.0f + r * r, -0.25f);
+        float cv = 2.0f * r1[l][0] - 1.0f, sv = std::sqrt(1.0f - cv * cv), psi = pi2 * r1[l][1];
+        s.vx[i] = v * sv * std::cos(psi);
+        s.vy[i] = v * sv * std::sin(psi);
+        s.vz[i] = v * cv;
+        s.mass[i] = 1.0f;
+        break;
+      }
+      }
+    }
+  }
+}
+
+/**
+ * @brief 所有段生成完之后的串行收尾：Plummer球移到质心系
+ *
+ * 按编号顺序用double求和，与生成时的线程数无关。
+ */
+void init_finish(Stars &s, InitKind kind) {
+  if (kind != InitKind::Plummer)
+    return;
+  double m = 0.0, c[6] = {};
+  float *a[6] = {s.px, s.py, s.pz, s.vx, s.vy, s.vz};
+  for (std::size_t i = 0; i < s.n; i++) {
+    m += s.mass[i];
+    for (int k = 0; k < 6; k++)
+      c[k] += (double)s.mass[i] * a[k][i];
+  }
+  for (int k = 0; k < 6; k++) {
+    float shift = (float)(c[k] / m);
+    for (std::size_t i = 0; i < s.n; i++)
+      a[k][i] -= shift;
+  }
+}
+
+
+/*
+✅ 混合精度累加（Precision）：
+
+ * calc()把NUM²项累加在一个float里，N大时误差随项数增长，能量守恒的检查变得很"吵"
+ * 全部换成double会让SIMD吞吐减半，所以位置和两两之间的计算（距离、rsqrt）保持float，
+   只有累加器换成double（Double）或Kahan补偿的float（Compensated）
+ * Precision是核函数的模板参数，Float时与原来完全相同，没有任何额外开销
+ * 对称模式和系综模式只有Float版本
+*/
+enum class Precision { Float, Double, Compensated };
+
+const char *precision_name(Precision p) {
+  switch (p) {
+  case Precision::Float: return "float";
+  case Precision::Double: return "double";
+  case Precision::Compensated: return "compensated";
+  }
+  return "?";
+}
+
+/**
+ * @brief 读取HW04_PRECISION=float|double|compensated，默认float
+ */
+Precision detect_precision() {
+  if (const char *env = std::getenv("HW04_PRECISION"))
+    for (Precision p : {Precision::Float, Precision::Double, Precision::Compensated})
+      if (std::strcmp(env, precision_name(p)) == 0)
+        return p;
+  return Precision::Float;
+}
+
+/**
+ * @brief 让编译器看不到v的来历，阻止-ffast-math把Kahan的补偿项(t - s) - y化简成0
+ */
+template <class T> inline T opaque(T v) {
+  asm("" : "+x"(v));
+  return v;
+}
+
+/**
+ * @brief 标量累加器：Float直接累加，Double用double累加，Compensated用Kahan求和
+ */
+template <Precision P> struct Sum {
+  float s = 0.0f;
+  void add(float x) { s += x; }
+  double value() const { return s; }
+};
+
+template <> struct Sum<Precision::Double> {
+  double s = 0.0;
+  void add(float x) { s += x; }
+  double value() const { return s; }
+};
+
+template <> struct Sum<Precision::Compensated> {
+  float s = 0.0f, c = 0.0f;
+  void add(float x) {
+    float y = opaque(x - c);
+    float t = opaque(s + y);
+    c = opaque(t - s) - y;
+    s = t;
+  }
+  double value() const { return (double)s - (double)c; }
+};
+
+/*
+✅ 硬件性能计数器（-DHW04_PERF=ON）：
+
+ * 不知道N变大后引力循环卡在FP吞吐、rsqrt延迟还是内存上，所以用perf_event_open
+   分别统计step()的引力阶段、位置更新阶段以及calc()的cycles/instructions/L1D读缺失/LLC缺失/FP指令数
+ * 五个计数器放在同一个group里一次read()读出，只统计用户态(exclude_kernel)，因此阶段边界上的
+   read()系统调用本身几乎不计入结果
+ * 只统计调用线程：main_mt的工作线程不计入，run_timesteps驱动不插桩，perf_report会注明这一点；
+   --bench里mt变体的计数同样只是0号线程的
+ * FP指令数用Intel的原始事件FP_ARITH_INST_RETIRED(0xC7，全部umask)，其他CPU上可以用
+   HW04_PERF_FP_RAW=<十六进制config>替换；打不开的计数器会被跳过并标记为不可用
+ * 关闭时HW04_PERF_BEGIN/HW04_PERF_NEXT展开为空语句，不产生任何代码
+*/
+enum PerfPhase { PERF_FORCE, PERF_DRIFT, PERF_CALC, PERF_NUM_PHASES };
+
+#ifdef HW04_PERF
+enum PerfCounter { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISS, PERF_LLC_MISS, PERF_FP, PERF_NUM_COUNTERS };
+
+const char *perf_phase_name(int p) {
+  static const char *names[] = {"force", "drift", "calc"};
+  return names[p];
+}
+
+const char *perf_counter_name(int c) {
+  static const char *names[] = {"cycles", "instructions", "l1d_miss", "llc_miss", "fp_ops"};
+  return names[c];
+}
+
+/**
+ * @brief 每个阶段累计的计数值，调用次数用来求平均
+ */
+struct PerfTotals {
+  std::uint64_t value[PERF_NUM_PHASES][PERF_NUM_COUNTERS] = {};
+  std::uint64_t calls[PERF_NUM_PHASES] = {};
+};
+
+class PerfCounters {
+public:
+  PerfCounters() {
+    std::uint64_t fp_raw = 0xffc7;
+    if (const char *env = std::getenv("HW04_PERF_FP_RAW"))
+      fp_raw = std::strtoull(env, nullptr, 16);
+    const std::uint64_t cache_l1d_read_miss =
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    struct { std::uint32_t type; std::uint64_t config; } events[PERF_NUM_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, cache_l1d_read_miss},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_RAW, fp_raw},
+    };
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof attr);
+      attr.size = sizeof attr;
+      attr.type = events[c].type;
+      attr.config = events[c].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      attr.disabled = leader_ < 0;
+      int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0);
+      if (fd < 0)
+        continue;
+      if (leader_ < 0)
+        leader_ = fd;
+      slot_[c] = members_++;
+      fds_.push_back(fd);
+    }
+    if (leader_ >= 0)
+      ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  ~PerfCounters() {
+    for (int fd : fds_)
+      close(fd);
+  }
+
+  bool available() const { return leader_ >= 0; }
+  bool has(int c) const { return slot_[c] >= 0; }
+
+  /**
+   * @brief 读出当前的全部计数值，不可用的计数器为0
+   */
+  void read(std::uint64_t out[PERF_NUM_COUNTERS]) const {
+    std::uint64_t buf[1 + PERF_NUM_COUNTERS] = {};
+    if (available() && ::read(leader_, buf, sizeof buf) <= 0)
+      buf[0] = 0;
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+      out[c] = slot_[c] >= 0 && (std::uint64_t)slot_[c] < buf[0] ? buf[1 + slot_[c]] : 0;
+  }
+
+  PerfTotals totals;
+
+private:
+  int leader_ = -1;
+  int members_ = 0;
+  int slot_[PERF_NUM_COUNTERS] = {-1, -1, -1, -1, -1};
+  std::vector<int> fds_;
+};
+
+PerfCounters &perf_counters() {
+  static PerfCounters counters;
+  return counters;
+}
+
+/**
+ * @brief 从构造开始把计数记到当前阶段，next()切换阶段，析构时结束
+ */
+class PerfPhaseScope {
+public:
+  explicit PerfPhaseScope(PerfPhase phase) : phase_(phase) { perf_counters().read(start_); }
+  ~PerfPhaseScope() { flush(); }
+
+  void next(PerfPhase phase) {
+    flush();
+    phase_ = phase;
+  }
+
+private:
+  void flush() {
+    PerfCounters &pc = perf_counters();
+    std::uint64_t now[PERF_NUM_COUNTERS];
+    pc.read(now);
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+      pc.totals.value[phase_][c] += now[c] - start_[c];
+      start_[c] = now[c];
+    }
+    pc.totals.calls[phase_]++;
+  }
+
+  PerfPhase phase_;
+  std::uint64_t start_[PERF_NUM_COUNTERS];
+};
+
+/**
+ * @brief 输出每个阶段每次调用的平均计数
+ */
+void perf_report(FILE *out, PerfTotals const &t) {
+  PerfCounters &pc = perf_counters();
+  if (!pc.available()) {
+    std::fprintf(out, "perf: counters unavailable (perf_event_open failed)\n");
+    return;
+  }
+  std::fprintf(out, "%-6s %10s", "phase", "calls");
+  for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+    std::fprintf(out, " %14s", perf_counter_name(c));
+  std::fprintf(out, " %6s\n", "ipc");
+  for (int p = 0; p < PERF_NUM_PHASES; p++) {
+    if (!t.calls[p])
+      continue;
+    std::fprintf(out, "%-6s %10llu", perf_phase_name(p), (unsigned long long)t.calls[p]);
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+      if (pc.has(c))
+        std::fprintf(out, " %14.1f", (double)t.value[p][c] / (double)t.calls[p]);
+      else
+        std::fprintf(out, " %14s", "n/a");
+    }
+    double cyc = (double)t.value[p][PERF_CYCLES];
+    std::fprintf(out, " %6.2f\n", cyc > 0 ? (double)t.value[p][PERF_INSTRUCTIONS] / cyc : 0.0);
+  }
+#ifdef HW04_MT
+  std::fprintf(out, "perf: main_mt counts the calling thread only; pool workers are not included "
+                    "and run_timesteps has no phase scopes\n");
+#endif
+}
+
+#define HW04_PERF_BEGIN(phase) PerfPhaseScope hw04_perf_scope(phase)
+#define HW04_PERF_NEXT(phase) hw04_perf_scope.next(phase)
+#else
+#define HW04_PERF_BEGIN(phase) ((void)0)
+#define HW04_PERF_NEXT(phase) ((void)0)
+#endif
 
 // 已应用的优化技术总结：
 
@@ -96,11 +736,11 @@ void init() {
 ✅ 1. SOA数据结构优化：
  * 将AOS(Structure of Arrays)转换为SOA(Structure of Arrays)
  * 相同属性的数据连续存储，提高缓存命中率和SIMD向量化效率
- * 使用std::array替代std::vector，消除动态内存分配开销
+ * 所有数组从同一个64字节对齐的arena中分配，长度补齐到SIMD宽度
 
 ✅ 2. 编译时常量优化：
  * 使用constexpr替代const，让编译器在编译时确定常量值
- * constexpr std::size_t NUM = 48; 提供编译时大小信息
+ * G、eps、dt的默认值在编译时确定(defaults)，N固定的特化核直接使用，运行时可改（见命令行一节）
  * 消除运行时类型转换，提高循环效率
 
 ✅ 3. 内存对齐优化：
@@ -124,9 +764,12 @@ void init() {
  * 最后一次性更新数组元素，提高缓存效率
 
 ✅ 7. 算法结构优化：
- * 放弃对称性优化，采用完整的O(n²)计算
+ * 默认放弃对称性优化，采用完整的O(n²)计算
  * 简单的循环结构更容易被编译器向量化
  * 虽然计算量增加，但SIMD效率提升更多
+ * 手写SIMD之后对称形式不再吃亏，作为可选的ForceMode::Symmetric保留（见step_symmetric）
+ * 生产规模（10^6体）另有Barnes-Hut八叉树ForceMode::Tree（见step_tree），不改变作业的O(n²)
+ * 10^7体且精度要求高时用快速多极子ForceMode::Fmm（见step_fmm）
 
 ✅ 8. 编译器优化指令：
  * 使用-ffast-math启用快速数学优化
@@ -143,56 +786,135 @@ void init() {
  * 减少中间变量，让编译器更好地优化
  * 提高指令级并行度
 
-🚫 未应用的优化（可考虑进一步优化）：
-❌ 手动SIMD指令：使用xmmintrin.h编写SIMD代码
-❌ 快速倒数平方根：用Q_rsqrt近似替代sqrt
-❌ 融合乘加指令：使用FMA优化乘加运算
-❌ 循环分块：提高缓存利用率
-❌ 避免自交互：i == j时的特殊处理
+✅ 11. 标量force之外，SIMD核（kernels.inc）已经应用的：
+ * 手动SIMD：SSE/AVX2/AVX-512三个版本的intrinsics核，运行时按CPU选择（见detect_isa）
+ * 快速倒数平方根：不用Q_rsqrt，用硬件rsqrt近似 + 一次Newton-Raphson迭代，1/|d|³取其立方，没有sqrt和除法
+ * 融合乘加：距离平方、引力累加和位置更新都用fmadd（AVX2/AVX-512是真正的FMA，SSE退化为乘 + 加）
+ * 循环分块：force_tiled_impl按TileConfig在i、j两个方向分块，每次同时算IB个i
+
+🚫 未应用的优化：
+❌ 避免自交互：i == j时dx = dy = dz = 0，软化后贡献恰好为0，不需要分支（见下面step()的说明）；
+   对称核的对角块用掩码去掉j <= i，是因为那里每对只算一次，与自交互无关
 */
 /**
- * @brief 计算星体间的引力相互作用，更新每个星体的速度和位置
+ * @brief 引力累加核：对每个真实星体i，out[i] += scale * Σ_j m_j * d_ij / |d_ij|³
  *
- * 该函数执行以下操作：
- * 1. 计算所有星体对之间的引力
- * 2. 根据引力更新每个星体的速度
- * 3. 根据速度更新每个星体的位置
+ * step()用scale = G * dt把结果直接加到速度上；积分器用G * h做任意长度h的kick。
+ * P决定每个星体的引力贡献用什么精度累加，默认Float即原始实现。
  */
-void step() {
-  const float t = G * dt;
+template <Precision P = Precision::Float>
+void force(Stars const &stars, float scale, float *ox, float *oy, float *oz) {
   const float epss = eps * eps;
   // 完整的O(n²)计算，不使用对称性优化
-  for (std::size_t i = 0; i < NUM; i++) {
+  // 外层只遍历真实星体，幽灵星体的速度保持为0；内层跑到padded，幽灵星体贡献为0
+  for (std::size_t i = 0; i < stars.n; i++) {
     // 缓存当前星体的坐标到局部变量
     float px = stars.px[i], py = stars.py[i], pz = stars.pz[i];
     // 使用局部变量累加所有引力贡献，避免频繁的内存写入
-    float vx = 0.0f, vy = 0.0f, vz = 0.0f;
-    for (std::size_t j = 0; j < NUM; j++) {
+    Sum<P> vx, vy, vz;
+    for (std::size_t j = 0; j < stars.padded; j++) {
       float dx = stars.px[j] - px;
       float dy = stars.py[j] - py;
       float dz = stars.pz[j] - pz;
       float d2 = dx * dx + dy * dy + dz * dz + epss;
       d2 *= std::sqrt(d2);
       // 老师版本的简洁计算方式
-      float xx = (1 / d2) * t * stars.mass[j];
+      float xx = (1 / d2) * scale * stars.mass[j];
       // 累加到局部变量，而不是直接写入内存
-      vx += dx * xx;
-      vy += dy * xx;
-      vz += dz * xx;
+      vx.add(dx * xx);
+      vy.add(dy * xx);
+      vz.add(dz * xx);
     }
-    // 一次性更新当前星体的速度
-    stars.vx[i] += vx;
-    stars.vy[i] += vy;
-    stars.vz[i] += vz;
+    // 一次性更新输出
+    ox[i] += (float)vx.value();
+    oy[i] += (float)vy.value();
+    oz[i] += (float)vz.value();
+  }
+}
+
+/**
+ * @brief 位置更新 p += v * h，幽灵星体速度为0，直接跑到padded
+ */
+void drift(Stars &stars, float h) {
+  for (std::size_t i = 0; i < stars.padded; i++) {
+    stars.px[i] += stars.vx[i] * h;
+    stars.py[i] += stars.vy[i] * h;
+    stars.pz[i] += stars.vz[i] * h;
   }
+}
+
+/**
+ * @brief 速度更新 v += scale * a / G，积分器用scale = G * h
+ */
+template <Precision P = Precision::Float> void kick(Stars &stars, float scale) {
+  force<P>(stars, scale, stars.vx, stars.vy, stars.vz);
+}
+
+/**
+ * @brief 计算星体间的引力相互作用，更新每个星体的速度和位置
+ *
+ * 该函数执行以下操作：
+ * 1. 计算所有星体对之间的引力（force）
+ * 2. 根据引力更新每个星体的速度
+ * 3. 根据速度更新每个星体的位置（drift）
+ *
+ * P决定每个星体的引力贡献用什么精度累加，默认Float即原始实现。
+ */
+template <Precision P = Precision::Float> void step(Stars &stars) {
+  HW04_PERF_BEGIN(PERF_FORCE);
+  force<P>(stars, G * dt, stars.vx, stars.vy, stars.vz);
   // 更新位置
-  for (std::size_t i = 0; i < NUM; i++) {
-    stars.px[i] += stars.vx[i] * dt;
-    stars.py[i] += stars.vy[i] * dt;
-    stars.pz[i] += stars.vz[i] * dt;
+  HW04_PERF_NEXT(PERF_DRIFT);
+  drift(stars, dt);
+}
+
+/**
+ * @brief 利用牛顿第三定律的标量参考实现：每对(i, j)只算一次，i < j
+ *
+ * 作用在i上的速度增量为 +t * m_j * d / |d|³，作用在j上的为 -t * m_i * d / |d|³，t = scale。
+ * 结果与kick()相同（仅舍入不同），rsqrt的次数减半。
+ */
+void kick_symmetric(Stars &stars, float scale) {
+  const float t = scale;
+  const float epss = eps * eps;
+  // j侧的增量先累加在临时数组里，最后一次性加到速度上，避免每对都舍入到速度
+  float *ax = scratch(3 * stars.padded), *ay = ax + stars.padded, *az = ay + stars.padded;
+  std::fill(ax, ax + 3 * stars.padded, 0.0f);
+  for (std::size_t i = 0; i < stars.n; i++) {
+    float px = stars.px[i], py = stars.py[i], pz = stars.pz[i];
+    float mi = stars.mass[i];
+    float vx = 0.0f, vy = 0.0f, vz = 0.0f;
+    for (std::size_t j = i + 1; j < stars.n; j++) {
+      float dx = stars.px[j] - px;
+      float dy = stars.py[j] - py;
+      float dz = stars.pz[j] - pz;
+      float d2 = dx * dx + dy * dy + dz * dz + epss;
+      d2 *= std::sqrt(d2);
+      float xx = 1 / d2;
+      float xi = xx * stars.mass[j], xj = xx * mi;
+      vx += dx * xi;
+      vy += dy * xi;
+      vz += dz * xi;
+      ax[j] -= dx * xj;
+      ay[j] -= dy * xj;
+      az[j] -= dz * xj;
+    }
+    stars.vx[i] += (ax[i] + vx) * t;
+    stars.vy[i] += (ay[i] + vy) * t;
+    stars.vz[i] += (az[i] + vz) * t;
   }
 }
 
+/**
+ * @brief ForceMode::Symmetric的标量step：kick_symmetric(G * dt)后drift(dt)
+ */
+void step_symmetric(Stars &stars) {
+  HW04_PERF_BEGIN(PERF_FORCE);
+  kick_symmetric(stars, G * dt);
+  HW04_PERF_NEXT(PERF_DRIFT);
+  drift(stars, dt);
+}
+
 /*
 ✅ 已应用的calc()函数优化技术：
 
@@ -237,18 +959,22 @@ void step() {
  * 1. 计算所有星体的动能
  * 2. 计算所有星体对之间的势能
  * 3. 返回总能量
+ *
+ * calc_range只对[i_begin, i_end)的i求和，多线程版本按段并行后再相加。
+ * P决定能量用什么精度累加，默认Float即原始实现。
  */
-float calc() {
-  float energy = 0;
+template <Precision P = Precision::Float>
+double calc_range(Stars const &stars, std::size_t i_begin, std::size_t i_end) {
+  Sum<P> energy;
   // SOA结构：使用索引访问而不是范围循环
-  for (std::size_t i = 0; i < NUM; i++) {
+  for (std::size_t i = i_begin; i < i_end && i < stars.n; i++) {
     float v2 = stars.vx[i] * stars.vx[i] + stars.vy[i] * stars.vy[i] +
                stars.vz[i] * stars.vz[i];
-    energy += stars.mass[i] * v2 * 0.5f;
+    energy.add(stars.mass[i] * v2 * 0.5f);
     float px = stars.px[i];
     float py = stars.py[i];
     float pz = stars.pz[i];
-    for (std::size_t j = 0; j < NUM; j++) {
+    for (std::size_t j = 0; j < stars.padded; j++) {
       float dx = stars.px[j] - px;
       float dy = stars.py[j] - py;
       float dz = stars.pz[j] - pz;
@@ -256,61 +982,4646 @@ float calc() {
       
       // 第二步优化：数学表达式优化 - 预计算倒数平方根
       float s_d2 = 1 / std::sqrt(d2);
-      energy -= stars.mass[j] * stars.mass[i] * G * 0.5f * s_d2;
+      energy.add(-(stars.mass[j] * stars.mass[i] * G * 0.5f * s_d2));
     }
   }
-  return energy;
+  return energy.value();
 }
 
-template <class Func> long benchmark(Func const &func) {
-  auto t0 = std::chrono::steady_clock::now();
-  func();
-  auto t1 = std::chrono::steady_clock::now();
-  auto dt = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0);
-  return dt.count();
+template <Precision P = Precision::Float> double calc(Stars const &stars) {
+  HW04_PERF_BEGIN(PERF_CALC);
+  return calc_range<P>(stars, 0, stars.n);
 }
 
 /*
-✅ 已应用的main函数优化技术：
+✅ 高阶辛积分器（HW04_INTEGRATOR=euler|leapfrog|yoshida4，HW04_DT=步长）：
 
-1. 函数内联优化：
- * 编译器能看到step()的完整实现
- * 在高优化级别下自动内联，消除函数调用开销
- * 但step()函数复杂，最终内联取决于编译器决策
+ * step()是一阶辛欧拉：kick(dt)后drift(dt)，能量误差随dt线性变化，要更准只能缩小dt
+ * leapfrog：drift(h/2) kick(h) drift(h/2)（DKD形式的速度Verlet），二阶，每步仍只算一次引力
+ * yoshida4：三个系数为w1, w0, w1的leapfrog子步，四阶，每步三次引力；相邻子步的半drift合并成一次
+ * 积分器只依赖kick(s, G * h)和drift(s, h)两个操作，标量和各ISA版本共用同一个integrate_step
+ * kick是KickFn，由select_kick按ForceMode选出：每个模式一个，main_mt用多线程版本；
+   它只更新速度，不drift、不动统计，step()里的引力阶段调用的是同一个核
+ * 总模拟时间默认固定为NUM_STEPS * defaults::dt，换更大的h时步数相应减少（detect_steps）
+ * 48体、t∈[0, 2]的最大能量误差：euler(h=0.01) 2.3e-3，leapfrog(h=0.08) 6.9e-4，
+   yoshida4(h=0.08) 4.0e-4，后两者的引力计算次数分别只有前者的1/8和3/8
+*/
+enum class Integrator { Euler, Leapfrog, Yoshida4, Block };
 
-2. Lambda表达式优化：
- * 使用benchmark模板函数和lambda表达式
- * 避免函数指针开销，提高内联可能性
- * 编译器能更好地优化循环结构
+const char *integrator_name(Integrator integ) {
+  switch (integ) {
+  case Integrator::Euler: return "euler";
+  case Integrator::Leapfrog: return "leapfrog";
+  case Integrator::Yoshida4: return "yoshida4";
+  case Integrator::Block: return "block";
+  }
+  return "?";
+}
 
-🚫 未应用的优化（测试后无效或不适用）：
+/**
+ * @brief 默认Euler（即step()），环境变量HW04_INTEGRATOR=leapfrog|yoshida4|block切换
+ */
+Integrator detect_integrator() {
+  if (const char *env = std::getenv("HW04_INTEGRATOR")) {
+    for (Integrator integ :
+         {Integrator::Euler, Integrator::Leapfrog, Integrator::Yoshida4, Integrator::Block})
+      if (std::strcmp(env, integrator_name(integ)) == 0)
+        return integ;
+  }
+  return Integrator::Euler;
+}
 
-❌ __attribute__((hot))：
- * 现代编译器已能自动识别热点函数
- * 手动标记可能不如编译器的静态分析准确
+/**
+ * @brief 用kick和drift推进一个长度为h的步
+ */
+template <Integrator I, class Kick, class Drift>
+inline void integrate_step(Stars &s, float h, Kick const &kick, Drift const &drift) {
+  if (I == Integrator::Euler) {
+    kick(s, h);
+    drift(s, h);
+  } else if (I == Integrator::Leapfrog) {
+    drift(s, 0.5f * h);
+    kick(s, h);
+    drift(s, 0.5f * h);
+  } else {
+    // w1 = 1 / (2 - 2^(1/3))，w0 = 1 - 2 * w1
+    constexpr double w1 = 1.3512071919596578, w0 = -1.7024143839193153;
+    drift(s, (float)(0.5 * w1 * h));
+    kick(s, (float)(w1 * h));
+    drift(s, (float)(0.5 * (w1 + w0) * h));
+    kick(s, (float)(w0 * h));
+    drift(s, (float)(0.5 * (w0 + w1) * h));
+    kick(s, (float)(w1 * h));
+    drift(s, (float)(0.5 * w1 * h));
+  }
+}
 
-❌ 循环分块(blocking)：
- * 当前数据访问模式已经缓存友好
- * 分块可能增加复杂度而收益有限
+/**
+ * @brief 积分器的kick：v += scale * a / G，scale = G * h；每个ForceMode各有一个，见select_kick
+ */
+using KickFn = void (*)(Stars &, float);
 
-❌ Profile-guided optimization(PGO)：
- * 需要额外的编译流程和训练数据
- * 对于固定规模的N体问题，收益不明显
+template <Integrator I> void step_integrator(Stars &s, float h, KickFn kick) {
+  integrate_step<I>(
+      s, h,
+      [kick](Stars &t, float k) {
+        HW04_PERF_BEGIN(PERF_FORCE);
+        kick(t, G * k);
+      },
+      [](Stars &t, float k) {
+        HW04_PERF_BEGIN(PERF_DRIFT);
+        drift(t, k);
+      });
+}
 
-❌ 其他编译器特定指令：
- * -ffast-math和-march=native已足够
- * 过度优化可能降低可移植性
+/*
+✅ 分层块时间步（HW04_INTEGRATOR=block）：
+
+ * 全局步长下，少数处于近距离交会的星体迫使所有星体都用很小的dt
+ * 每个星体有自己的层级k，步长为h / 2^k，h = 2^BLOCK_COARSE * HW04_DT是最大步长（大步），
+   层级由加速度与加加速度算出：dt_i = η * |a_i| / |j_i|（η由HW04_BLOCK_ETA设置），
+   最多BLOCK_MAX_LEVEL层；总模拟时间不变，大步数按h换算，HW04_STEPS指定的是大步数
+ * 默认参数的选择标准：48体默认运行的最终能量误差低于欧拉(h = HW04_DT)，t∈[0, 2]的最大能量误差
+   低于leapfrog(h = 8 * HW04_DT)，同时每个子步的活跃比例明显小于1。这个规模下长时间运行的能量误差
+   主要来自float位置的舍入，随子步数增加而变大：h = HW04_DT时无论η取多少，几乎所有星体都停在第0层
+   （活跃比例0.976），误差反而比欧拉大（1.44e-2对1.00e-2）。h = 8 * HW04_DT、η = 0.01时
+   活跃比例0.71，最终误差4.3e-3，t∈[0, 2]的最大误差1.2e-5，用时约为欧拉的1/3
+ * 每个子步只有步长在此结束的"活跃"星体重新计算引力：把活跃的i压缩成一个下标列表，
+   交给force_active核对全部j求和，避免每个子步都做完整的NUM×NUM计算
+ * 每个星体各自是KDK leapfrog：步开始时用当前加速度kick半步，步结束时用新加速度kick半步；
+   所有位置每个子步都drift到当前时刻（O(N)），活跃星体看到的是所有星体的当前位置
+ * 层级只能在与更粗的步长对齐的时刻变粗，保证块结构始终同步
+ * 每个大步h结束时所有星体同时结束，速度和位置同步，calc()的能量检查照常适用
+ * 状态（加速度、层级）按星体下标保存，因此块时间步模式下不做HW04_REORDER重排
+ * 活跃星体核只有直接求和，其他HW04_FORCE与块时间步组合时直接报错
 */
-int main() {
-  init();
-  printf("Initial energy: %f\n", calc());
-  auto dt = benchmark([&] {
-    // 这里可以优化，编译器能看到step()的实现，在高优化级别下可能会自动内联以消除函数调用开销，
-    // 但由于step()函数包含嵌套循环且较为复杂，最终是否内联取决于编译器的内联阈值和代码膨胀考量
-    for (int i = 0; i < 100000; i++)
-      step();
-  });
-  printf("Final energy: %f\n", calc());
-  printf("Time elapsed: %ld ms\n", dt);
+constexpr int BLOCK_MAX_LEVEL = 10;
+constexpr int BLOCK_COARSE = 3; // 大步是2^BLOCK_COARSE个HW04_DT
+
+/**
+ * @brief 活跃星体的引力与加加速度核：
+ * 对count个下标active[k]，输出a_k = G Σ_j m_j d / |d|³，j_k = da_k/dt（都已乘G）
+ */
+using ActiveForceFn = void (*)(Stars const &, std::uint32_t const *, std::size_t, float *,
+                               float *, float *, float *, float *, float *);
+
+struct BlockState {
+  std::size_t n = 0;
+  float const *owner = nullptr;      // 状态属于哪一组星体（Stars的px），换了星体就重新初始化
+  float eta = 0.01f;
+  std::vector<float> ax, ay, az;     // 每个星体最近一次计算的加速度
+  std::vector<std::uint8_t> level;   // 每个星体的层级，步长为h >> level
+  std::vector<std::uint32_t> active; // 本子步活跃星体的下标
+  std::vector<float> buf;            // 活跃星体的a与j，6 * count
+  long substeps = 0, updates = 0;    // 统计：子步数与活跃星体更新次数
+
+  /**
+   * @brief 丢弃加速度与层级，下一次block_step重新初始化；每次运行开始时调用
+   */
+  void reset() {
+    n = 0;
+    owner = nullptr;
+    substeps = updates = 0;
+  }
+};
+
+/**
+ * @brief 进程唯一的块时间步状态，第一次使用时读取HW04_BLOCK_ETA
+ */
+BlockState &block_state() {
+  static BlockState state = [] {
+    BlockState b;
+    if (const char *env = std::getenv("HW04_BLOCK_ETA")) {
+      float eta = std::strtof(env, nullptr);
+      if (eta > 0.0f)
+        b.eta = eta;
+    }
+    return b;
+  }();
+  return state;
+}
+
+/**
+ * @brief 由加速度和加加速度选层级：满足 h / 2^k <= η |a| / |j| 的最小k
+ */
+inline int block_level(float h, float eta, float ax, float ay, float az, float jx, float jy,
+                       float jz) {
+  float a2 = ax * ax + ay * ay + az * az, j2 = jx * jx + jy * jy + jz * jz;
+  if (j2 <= 0.0f)
+    return 0;
+  float want = eta * std::sqrt(a2 / j2);
+  int k = 0;
+  while (k < BLOCK_MAX_LEVEL && h / (float)(1 << k) > want)
+    k++;
+  return k;
+}
+
+/**
+ * @brief 计算st.active前count个星体的加速度与加加速度，结果放在st.buf中
+ */
+inline void block_forces(Stars const &s, BlockState &st, ActiveForceFn force, std::size_t count) {
+  st.buf.resize(6 * count);
+  float *b = st.buf.data();
+  force(s, st.active.data(), count, b, b + count, b + 2 * count, b + 3 * count, b + 4 * count,
+        b + 5 * count);
+  st.updates += (long)count;
+}
+
+/**
+ * @brief 用块时间步推进一个大步h，结束时所有星体同步
+ */
+inline void block_step(Stars &s, float h, ActiveForceFn force) {
+  BlockState &st = block_state();
+  const std::size_t n = s.n;
+  const std::uint32_t ticks = 1u << BLOCK_MAX_LEVEL; // 一个大步内最细一层的子步数
+  float *b = nullptr;
+  if (st.n != n || st.owner != s.px) {
+    // 第一次（或换了一组星体）：所有星体都算一次引力，确定初始层级
+    st.n = n;
+    st.owner = s.px;
+    st.ax.assign(n, 0.0f), st.ay.assign(n, 0.0f), st.az.assign(n, 0.0f);
+    st.level.assign(n, 0);
+    st.active.resize(n);
+    for (std::size_t i = 0; i < n; i++)
+      st.active[i] = (std::uint32_t)i;
+    block_forces(s, st, force, n);
+    b = st.buf.data();
+    for (std::size_t i = 0; i < n; i++) {
+      st.ax[i] = b[i], st.ay[i] = b[n + i], st.az[i] = b[2 * n + i];
+      st.level[i] = (std::uint8_t)block_level(h, st.eta, b[i], b[n + i], b[2 * n + i],
+                                              b[3 * n + i], b[4 * n + i], b[5 * n + i]);
+    }
+  }
+  // 大步开始：每个星体按自己的步长kick半步
+  for (std::size_t i = 0; i < n; i++) {
+    float half = 0.5f * h / (float)(1 << st.level[i]);
+    s.vx[i] += st.ax[i] * half;
+    s.vy[i] += st.ay[i] * half;
+    s.vz[i] += st.az[i] * half;
+  }
+  std::uint32_t tick = 0;
+  while (tick < ticks) {
+    // 下一个时刻：当前最细层级的步长结束的时刻（tick总是它的整数倍）
+    int finest = *std::max_element(st.level.begin(), st.level.end());
+    std::uint32_t next = tick + (ticks >> finest);
+    drift(s, h * (float)(next - tick) / (float)ticks);
+    tick = next;
+    std::size_t count = 0;
+    st.active.resize(n);
+    for (std::size_t i = 0; i < n; i++)
+      if (tick % (ticks >> st.level[i]) == 0)
+        st.active[count++] = (std::uint32_t)i;
+    block_forces(s, st, force, count);
+    st.substeps++;
+    b = st.buf.data();
+    for (std::size_t k = 0; k < count; k++) {
+      std::uint32_t i = st.active[k];
+      float ax = b[k], ay = b[count + k], az = b[2 * count + k];
+      // 用新位置的加速度结束旧步
+      float half = 0.5f * h / (float)(1 << st.level[i]);
+      s.vx[i] += ax * half;
+      s.vy[i] += ay * half;
+      s.vz[i] += az * half;
+      st.ax[i] = ax, st.ay[i] = ay, st.az[i] = az;
+      int want = block_level(h, st.eta, ax, ay, az, b[3 * count + k], b[4 * count + k],
+                             b[5 * count + k]);
+      // 变细随时可以；变粗只能到与当前时刻对齐的层级
+      int lvl = st.level[i];
+      if (want > lvl)
+        lvl = want;
+      else
+        while (lvl > want && tick % (ticks >> (lvl - 1)) == 0)
+          lvl--;
+      st.level[i] = (std::uint8_t)lvl;
+      if (tick < ticks) {
+        // 开始新步
+        half = 0.5f * h / (float)(1 << lvl);
+        s.vx[i] += ax * half;
+        s.vy[i] += ay * half;
+        s.vz[i] += az * half;
+      }
+    }
+  }
+}
+
+/*
+✅ 手写SIMD核函数 + 运行时ISA分派：
+
+1. 不再依赖编译器自动向量化：
+ * 内层j循环在-ffast-math下能否向量化随编译器版本变化
+ * 用intrinsics显式写出SSE(4路)、AVX2+FMA(8路)、AVX-512F(16路)三个版本
+
+2. rsqrt + 一次Newton-Raphson迭代：
+ * y = rsqrt(x)，y' = 0.5 * y * (3 - x * y * y)，精度接近完整float
+ * 1/|d|³ = y'³，去掉了sqrt和除法
+
+3. 运行时分派：
+ * 三个版本都用 #pragma GCC target 编译进同一个二进制
+ * 启动时用 __builtin_cpu_supports（基于CPUID，同时检查OS是否保存了对应寄存器）选择最快的版本
+ * 环境变量 HW04_ISA=scalar|sse|avx2|avx512 可以强制选择，但不会超过CPU实际支持的ISA
+ * 环境变量 HW04_FORCE=full|symmetric|tree|fmm 选择引力计算方式（见ForceMode）
+ * 全局的step()保留为标量参考实现
+*/
+
+/*
+✅ 压缩的j侧布局（HW04_FORCE=compressed）：
+
+ * N很大时分块核的瓶颈是j侧数据的带宽，每个j星体要读px/py/pz/mass共16字节
+ * 每SIMD_WIDTH个连续星体为一块，块中心(cx, cy, cz)与量化步长用float存放，
+   坐标存成相对块中心的int16定点偏移，质量存成float16，每个j星体6 + 2字节，加上块头共9字节
+ * 核函数里把int16扩展成int32再转float、float16按位移到float的位置，解码只在寄存器里做
+ * 每步开始时重新编码一次（O(N)，相对O(N²)可以忽略）；i侧也用解码后的坐标，自作用的dx恰好为0
+ * 块内星体越集中量化误差越小，配合HW04_REORDER的Morton重排效果最好；
+   坐标的相对误差约为块尺寸 / 65534，质量的相对误差约为2⁻¹¹，见启动时的精度报告
+*/
+struct PackedStars {
+  std::size_t padded = 0;
+  float *center = nullptr;       // 每块4个float：cx, cy, cz, 量化步长
+  std::int16_t *qx = nullptr, *qy = nullptr, *qz = nullptr; // 相对块中心的定点偏移
+  std::uint16_t *mass = nullptr; // float16的位模式，只存非负数
+  Arena arena;
+};
+
+/**
+ * @brief 非负float编码成float16（就近舍入），大于65504的饱和，小于2⁻¹⁴的当作0
+ *
+ * 乘2⁻¹¹²把float的指数偏置换成float16的偏置，尾数截掉低13位即可，解码时反过来左移13位再乘2¹¹²。
+ */
+inline std::uint16_t encode_half(float x) {
+  std::uint32_t bits;
+  float y = x * 0x1p-112f;
+  std::memcpy(&bits, &y, sizeof bits);
+  if (x < 0x1p-14f)
+    return 0;
+  if (x >= 65504.0f)
+    return 0x7bff;
+  return (std::uint16_t)((bits + 0x1000u) >> 13);
+}
+
+/**
+ * @brief 把s编码成压缩布局，p的容量不够时重新分配
+ *
+ * 幽灵星体不参与包围盒，偏移和质量都为0；量化步长 = 块的最大半边长 / 32767。
+ */
+void pack(Stars const &s, PackedStars &p) {
+  if (p.padded != s.padded) {
+    const std::size_t tiles = s.padded / SIMD_WIDTH;
+    // int16每个占半个float
+    p.arena = Arena((4 * tiles + 2 * s.padded + 4 * CACHE_LINE) * sizeof(float));
+    p.center = p.arena.take(4 * tiles);
+    p.qx = reinterpret_cast<std::int16_t *>(p.arena.take(s.padded / 2));
+    p.qy = reinterpret_cast<std::int16_t *>(p.arena.take(s.padded / 2));
+    p.qz = reinterpret_cast<std::int16_t *>(p.arena.take(s.padded / 2));
+    p.mass = reinterpret_cast<std::uint16_t *>(p.arena.take(s.padded / 2));
+    p.padded = s.padded;
+  }
+  for (std::size_t t = 0; t * SIMD_WIDTH < s.padded; t++) {
+    const std::size_t b = t * SIMD_WIDTH, e = std::min(b + SIMD_WIDTH, s.n);
+    float lo[3] = {0.0f, 0.0f, 0.0f}, hi[3] = {0.0f, 0.0f, 0.0f};
+    float const *pos[3] = {s.px, s.py, s.pz};
+    for (int a = 0; a < 3 && b < e; a++) {
+      lo[a] = hi[a] = pos[a][b];
+      for (std::size_t i = b + 1; i < e; i++) {
+        lo[a] = std::min(lo[a], pos[a][i]);
+        hi[a] = std::max(hi[a], pos[a][i]);
+      }
+    }
+    float half = 0.0f, *c = p.center + 4 * t;
+    for (int a = 0; a < 3; a++) {
+      c[a] = 0.5f * (lo[a] + hi[a]);
+      half = std::max(half, 0.5f * (hi[a] - lo[a]));
+    }
+    c[3] = half / 32767.0f;
+    const float inv = half > 0.0f ? 32767.0f / half : 0.0f;
+    std::int16_t *q[3] = {p.qx, p.qy, p.qz};
+    for (std::size_t i = b; i < b + SIMD_WIDTH; i++) {
+      const bool real = i < e;
+      for (int a = 0; a < 3; a++) {
+        long v = real ? std::lrint((pos[a][i] - c[a]) * inv) : 0;
+        q[a][i] = (std::int16_t)std::max(-32767L, std::min(32767L, v));
+      }
+      p.mass[i] = real ? encode_half(s.mass[i]) : 0;
+    }
+  }
+}
+
+/**
+ * @brief 进程内唯一的压缩布局缓冲区，ForceMode::Compressed每步复用
+ */
+PackedStars &packed_stars() {
+  static PackedStars p;
+  return p;
+}
+
+/*
+✅ 逐星体的引力输出（HW04_OUTPUTS=1）：
+
+ * step()把引力直接累加进速度，分析代码想要加速度和最近邻距离就只能再算一遍O(N²)
+ * force_outputs在同一遍里把加速度(已乘G)、到最近邻的距离平方(含软化)和最近邻编号
+   写进调用者提供的SOA缓冲区ForceOutput，不修改Stars
+ * 速度更新v += dt * a变成独立的O(N)阶段(apply_accelerations)，再接原来的位置更新
+ * 最近邻不含自身和幽灵星体；每个lane各自维护最小值和编号，每个j块结束后再与之前的结果合并
+*/
+struct ForceOutput {
+  std::size_t padded = 0;
+  float *ax = nullptr, *ay = nullptr, *az = nullptr; // 加速度 G Σ_j m_j d / |d|³
+  float *min_d2 = nullptr;                           // 到最近邻的 |d|² + eps²
+  std::uint32_t *nearest = nullptr;                  // 最近邻的下标，n == 1时为0
+  Arena arena;
+
+  ForceOutput() = default;
+  explicit ForceOutput(std::size_t padded_) : padded(padded_), arena(5 * padded_ * sizeof(float)) {
+    ax = arena.take(padded);
+    ay = arena.take(padded);
+    az = arena.take(padded);
+    min_d2 = arena.take(padded);
+    nearest = reinterpret_cast<std::uint32_t *>(arena.take(padded));
+  }
+};
+
+/**
+ * @brief 进程内唯一的输出缓冲区，HW04_OUTPUTS模式的step写到这里，星体数变化时重新分配
+ */
+ForceOutput &force_output(std::size_t padded) {
+  static ForceOutput out;
+  if (out.padded != padded)
+    out = ForceOutput(padded);
+  return out;
+}
+
+/**
+ * @brief lane编号0, 1, 2, ...，SIMD核用它构造j的下标向量
+ */
+alignas(64) constexpr float LANE_INDEX[SIMD_WIDTH] = {0, 1, 2,  3,  4,  5,  6,  7,
+                                                      8, 9, 10, 11, 12, 13, 14, 15};
+
+/*
+✅ 近场邻居表（HW04_FORCE=cutoff，HW04_CUTOFF=截断半径，HW04_SKIN=皮层厚度）：
+
+ * 短程力只在r < r_c内非零，遍历全部N²对是浪费：用格子（边长 >= r_c + skin）把星体分桶，
+   每个i只检查周围27个格子，把r < r_c + skin的j记进Verlet邻居表，力的计算是O(N·k)
+ * 皮层复用：记下建表时的位置，只要所有星体的位移都不超过skin / 2，任何一对星体都不可能
+   从表外进入r_c之内，表继续有效；每步只需O(N)的位移检查
+ * r_c没有默认值，HW04_FORCE=cutoff必须同时给出HW04_CUTOFF：短程截断去掉了远处星体的束缚，
+   r_c比系统尺寸小时系统会散开，任何由初始状态推出的r_c在长时间运行后邻居表都是空的；
+   运行结束时平均邻居数不到1会给出警告
+ * skin默认按初始状态确定（configure）：2·K·max|v|·h（K = 10），按初始的最大速度一张表至少用K次，
+   不小于0.3·r_c；固定的skin = 0.3·r_c在r_c较小时比一步的最大位移还小，每步都要重建
+ * 每个i的邻居数补齐到SIMD_WIDTH的倍数，空位填i自己（d = 0，贡献恰好为0），
+   SIMD核按W个下标一组gather，没有尾部循环
+ * 分桶是稳定的计数排序，每个格子里的星体保持数组顺序；配合HW04_REORDER的Morton重排，
+   同一个i的邻居在内存里也是相邻的，gather基本命中L1。重排后星体下标都变了，邻居表随之作废
+ * 短程力取软化引力的"shifted-force"截断：a = G Σ m_j d (s(r)⁻³ - s(r_c)⁻³)，s(r) = √(r² + eps²)，
+   在r_c处连续地降到0；r_c大于系统尺寸时与直接求和一致
+ * 能量输出用与这个力配对的势能（cutoff_energy），U = -G m_i m_j [1/s(r) - 1/s(r_c) - (r_c² - r²) / (2 s(r_c)³)]，
+   这样能量漂移反映的才是截断动力学本身的积分误差
+*/
+struct NeighborList {
+  static constexpr int SKIN_STEPS = 10; // 默认skin按初始最大速度至少能用的步数
+
+  float cutoff = 0.1f, skin = 0.03f;
+  std::size_t n = 0;
+  bool valid = false;
+  std::vector<std::uint32_t> offset; // 第i个星体的邻居在index[offset[i], offset[i + 1])，SIMD_WIDTH对齐
+  std::vector<std::uint32_t> index;
+  std::vector<float> ref;            // 建表时的位置，3 * n
+  std::vector<std::uint32_t> cell, cell_start, cell_items;
+  long builds = 0, steps = 0;        // 重建次数与update()次数（每次引力计算一次，积分器每步可能多次）
+  double pairs = 0.0;                // 所有建表中真实邻居数之和
+
+  /**
+   * @brief 读取HW04_CUTOFF（check_options保证已设置），skin取HW04_SKIN或按初始状态确定；h是积分步长
+   */
+  void configure(Stars const &s, float h) {
+    if (const char *env = std::getenv("HW04_CUTOFF"))
+      cutoff = std::strtof(env, nullptr);
+    if (const char *env = std::getenv("HW04_SKIN")) {
+      skin = std::strtof(env, nullptr);
+    } else {
+      float v2 = 0.0f;
+      for (std::size_t i = 0; i < s.n; i++)
+        v2 = std::max(v2, s.vx[i] * s.vx[i] + s.vy[i] * s.vy[i] + s.vz[i] * s.vz[i]);
+      skin = std::max(2.0f * SKIN_STEPS * std::sqrt(v2) * h, 0.3f * cutoff);
+    }
+    valid = false;
+  }
+
+  /**
+   * @brief 需要时重建，返回是否重建了
+   */
+  bool update(Stars const &s) {
+    steps++;
+    if (valid && n == s.n) {
+      const float limit = 0.25f * skin * skin;
+      bool moved = false;
+      for (std::size_t i = 0; i < n && !moved; i++) {
+        float dx = s.px[i] - ref[3 * i], dy = s.py[i] - ref[3 * i + 1], dz = s.pz[i] - ref[3 * i + 2];
+        moved = dx * dx + dy * dy + dz * dz > limit;
+      }
+      if (!moved)
+        return false;
+    }
+    build(s);
+    return true;
+  }
+
+  void build(Stars const &s) {
+    n = s.n;
+    const float reach = cutoff + skin, reach2 = reach * reach;
+    float lo[3] = {0.0f, 0.0f, 0.0f}, hi[3] = {0.0f, 0.0f, 0.0f};
+    float const *pos[3] = {s.px, s.py, s.pz};
+    for (int a = 0; a < 3 && n; a++) {
+      lo[a] = hi[a] = pos[a][0];
+      for (std::size_t i = 1; i < n; i++) {
+        lo[a] = std::min(lo[a], pos[a][i]);
+        hi[a] = std::max(hi[a], pos[a][i]);
+      }
+    }
+    // 格子边长不小于reach；星体很稀疏时放大格子，格子总数不超过8N
+    float size = reach;
+    std::size_t dims[3];
+    for (;;) {
+      std::size_t total = 1;
+      for (int a = 0; a < 3; a++) {
+        dims[a] = n ? std::max<std::size_t>(1, (std::size_t)((hi[a] - lo[a]) / size)) : 1;
+        total *= dims[a];
+      }
+      if (total <= std::max<std::size_t>(8 * n, 64))
+        break;
+      size *= 2.0f;
+    }
+    const std::size_t cells = dims[0] * dims[1] * dims[2];
+    auto coord = [&](int a, float x) {
+      return std::min(dims[a] - 1, (std::size_t)std::max(0.0f, (x - lo[a]) / size));
+    };
+    cell.resize(n);
+    cell_start.assign(cells + 1, 0);
+    for (std::size_t i = 0; i < n; i++) {
+      cell[i] = (std::uint32_t)((coord(2, s.pz[i]) * dims[1] + coord(1, s.py[i])) * dims[0] +
+                                coord(0, s.px[i]));
+      cell_start[cell[i] + 1]++;
+    }
+    for (std::size_t c = 0; c < cells; c++)
+      cell_start[c + 1] += cell_start[c];
+    cell_items.resize(n);
+    {
+      std::vector<std::uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+      for (std::size_t i = 0; i < n; i++)
+        cell_items[fill[cell[i]]++] = (std::uint32_t)i;
+    }
+    offset.assign(n + 1, 0);
+    index.clear();
+    for (std::size_t i = 0; i < n; i++) {
+      const std::size_t cx = coord(0, s.px[i]), cy = coord(1, s.py[i]), cz = coord(2, s.pz[i]);
+      for (std::size_t z = cz ? cz - 1 : 0; z <= std::min(cz + 1, dims[2] - 1); z++)
+        for (std::size_t y = cy ? cy - 1 : 0; y <= std::min(cy + 1, dims[1] - 1); y++)
+          for (std::size_t x = cx ? cx - 1 : 0; x <= std::min(cx + 1, dims[0] - 1); x++) {
+            const std::size_t c = (z * dims[1] + y) * dims[0] + x;
+            for (std::uint32_t k = cell_start[c]; k < cell_start[c + 1]; k++) {
+              const std::uint32_t j = cell_items[k];
+              float dx = s.px[j] - s.px[i], dy = s.py[j] - s.py[i], dz = s.pz[j] - s.pz[i];
+              if (j != i && dx * dx + dy * dy + dz * dz < reach2)
+                index.push_back(j);
+            }
+          }
+      pairs += (double)(index.size() - offset[i]);
+      while (index.size() % SIMD_WIDTH)
+        index.push_back((std::uint32_t)i);
+      offset[i + 1] = (std::uint32_t)index.size();
+    }
+    ref.resize(3 * n);
+    for (std::size_t i = 0; i < n; i++) {
+      ref[3 * i] = s.px[i];
+      ref[3 * i + 1] = s.py[i];
+      ref[3 * i + 2] = s.pz[i];
+    }
+    valid = true;
+    builds++;
+  }
+};
+
+/**
+ * @brief 进程内唯一的邻居表，main在星体初始化之后调用configure
+ */
+NeighborList &neighbor_list() {
+  static NeighborList list;
+  return list;
+}
+
+/**
+ * @brief 截断模式的总能量：动能 + shifted-force势能，-∇U正好是force_neighbors算的加速度
+ *
+ * 直接O(N²)地在double里求和而不读邻居表：表可能已经因为重排作废，update()还会计入步数统计；
+ * 能量只在输出时计算，代价与calc()相同。和calc()一样计入i = j的自能常数，r_c大于系统尺寸时两者一致。
+ */
+double cutoff_energy(Stars const &stars) {
+  const double rc = neighbor_list().cutoff;
+  const double rc2 = rc * rc;
+  const double sc = std::sqrt(rc2 + (double)eps_sqr);
+  const double shift = 1.0 / sc, slope = 0.5 / (sc * sc * sc);
+  double kinetic = 0.0, potential = 0.0;
+  for (std::size_t i = 0; i < stars.n; i++) {
+    double v2 = (double)stars.vx[i] * stars.vx[i] + (double)stars.vy[i] * stars.vy[i] +
+                (double)stars.vz[i] * stars.vz[i];
+    kinetic += 0.5 * stars.mass[i] * v2;
+    potential -= 0.5 * (double)stars.mass[i] * stars.mass[i] * (1.0 / std::sqrt((double)eps_sqr) - shift - rc2 * slope);
+    for (std::size_t j = i + 1; j < stars.n; j++) {
+      double dx = (double)stars.px[j] - stars.px[i];
+      double dy = (double)stars.py[j] - stars.py[i];
+      double dz = (double)stars.pz[j] - stars.pz[i];
+      double r2 = dx * dx + dy * dy + dz * dz;
+      if (r2 >= rc2)
+        continue;
+      double u = 1.0 / std::sqrt(r2 + eps_sqr) - shift - (rc2 - r2) * slope;
+      potential -= (double)stars.mass[i] * stars.mass[j] * u;
+    }
+  }
+  return kinetic + G * potential;
+}
+
+/*
+✅ 分块（cache blocking）：
+
+ * 星体数超过几万后，每个i都要把px/py/pz/mass从L2/L3重新读一遍
+ * j方向按L1大小分块(j_tile)，同一个j块被一组i反复使用；i方向按L2大小分块(i_chunk)
+ * 每次同时算IB个i星体，它们的坐标和累加器常驻寄存器，一次j加载供IB个i使用
+ * 缓存大小在运行时检测，块大小随之确定；N=48时只有一块，等价于寄存器分块的直接求和
+*/
+struct TileConfig {
+  std::size_t i_chunk; // 每个i块的星体数，i侧数据(位置+累加器)占L2的一半
+  std::size_t j_tile;  // 每个j块的星体数，j侧数据(px/py/pz/mass)占L1的一半
+};
+
+std::size_t cache_size(int level) {
+  long r = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+  if (r > 0)
+    return (std::size_t)r;
+  // 部分libc/容器里sysconf返回0，退回读取sysfs
+  char path[96];
+  std::snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu0/cache/index%d/size",
+                level == 1 ? 0 : 2);
+  std::size_t kb = 0;
+  if (FILE *f = std::fopen(path, "r")) {
+    if (std::fscanf(f, "%zuK", &kb) != 1)
+      kb = 0;
+    std::fclose(f);
+  }
+  if (kb)
+    return kb * 1024;
+  return level == 1 ? 32 * 1024 : 1024 * 1024;
+}
+
+TileConfig const &tile_config() {
+  static const TileConfig cfg = [] {
+    auto fit = [](std::size_t bytes, std::size_t per_body) {
+      std::size_t n = bytes / 2 / per_body / SIMD_WIDTH * SIMD_WIDTH;
+      return n < SIMD_WIDTH ? SIMD_WIDTH : n;
+    };
+    return TileConfig{fit(cache_size(2), 6 * sizeof(float)),
+                      fit(cache_size(1), 4 * sizeof(float))};
+  }();
+  return cfg;
+}
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace sse {
+using V = __m128;
+constexpr std::size_t W = 4;
+constexpr std::size_t IB = 2; // 同时计算的i星体数：16个向量寄存器只够2组累加器
+inline V load(const float *p) { return _mm_load_ps(p); }
+inline V loadu(const float *p) { return _mm_loadu_ps(p); }
+inline void store(float *p, V v) { _mm_store_ps(p, v); }
+inline V set1(float x) { return _mm_set1_ps(x); }
+inline V zero() { return _mm_setzero_ps(); }
+inline V add(V a, V b) { return _mm_add_ps(a, b); }
+inline V sub(V a, V b) { return _mm_sub_ps(a, b); }
+inline V mul(V a, V b) { return _mm_mul_ps(a, b); }
+inline V fmadd(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); } // SSE没有FMA
+inline V rsqrt(V x) {
+  V y = _mm_rsqrt_ps(x); // 约12位精度
+  V xyy = mul(mul(x, y), y);
+  return mul(mul(set1(0.5f), y), sub(set1(3.0f), xyy));
+}
+inline float hsum(V v) {
+  V t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+  return _mm_cvtss_f32(t);
+}
+using VD = __m128d;
+inline VD zerod() { return _mm_setzero_pd(); }
+inline VD addd(VD a, VD b) { return _mm_add_pd(a, b); }
+inline VD widen_lo(V v) { return _mm_cvtps_pd(v); }
+inline VD widen_hi(V v) { return _mm_cvtps_pd(_mm_movehl_ps(v, v)); }
+inline double hsumd(VD v) { return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v))); }
+inline V load_q16(const std::int16_t *p) { // SSE2没有cvtepi16_epi32，复制到高16位再算术右移
+  __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+}
+inline V load_f16(const std::uint16_t *p) {
+  __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return _mm_castsi128_ps(_mm_slli_epi32(_mm_unpacklo_epi16(x, _mm_setzero_si128()), 13));
+}
+using M = V; // SSE的比较结果是全1/全0的向量
+inline M less(V a, V b) { return _mm_cmplt_ps(a, b); }
+inline V select(M m, V a, V b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+inline V gather(const float *p, const std::uint32_t *idx) { // SSE没有gather
+  return _mm_setr_ps(p[idx[0]], p[idx[1]], p[idx[2]], p[idx[3]]);
+}
+inline V opaque(V v) {
+  asm("" : "+x"(v)); // 与全局的opaque相同，但在本ISA的target区域内实例化，不涉及跨ABI的向量返回
+  return v;
+}
+#include "kernels.inc"
+} // namespace sse
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace avx2 {
+using V = __m256;
+constexpr std::size_t W = 8;
+constexpr std::size_t IB = 2; // 同时计算的i星体数：16个向量寄存器只够2组累加器
+inline V load(const float *p) { return _mm256_load_ps(p); }
+inline V loadu(const float *p) { return _mm256_loadu_ps(p); }
+inline void store(float *p, V v) { _mm256_store_ps(p, v); }
+inline V set1(float x) { return _mm256_set1_ps(x); }
+inline V zero() { return _mm256_setzero_ps(); }
+inline V add(V a, V b) { return _mm256_add_ps(a, b); }
+inline V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+inline V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+inline V fmadd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+inline V rsqrt(V x) {
+  V y = _mm256_rsqrt_ps(x); // 约12位精度
+  V xyy = mul(mul(x, y), y);
+  return mul(mul(set1(0.5f), y), sub(set1(3.0f), xyy));
+}
+inline float hsum(V v) {
+  __m128 t = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+  t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+  return _mm_cvtss_f32(t);
+}
+using VD = __m256d;
+inline VD zerod() { return _mm256_setzero_pd(); }
+inline VD addd(VD a, VD b) { return _mm256_add_pd(a, b); }
+inline VD widen_lo(V v) { return _mm256_cvtps_pd(_mm256_castps256_ps128(v)); }
+inline VD widen_hi(V v) { return _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)); }
+inline double hsumd(VD v) {
+  __m128d t = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(t, _mm_unpackhi_pd(t, t)));
+}
+inline V load_q16(const std::int16_t *p) {
+  __m256i x = _mm256_cvtepi16_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(p)));
+  return _mm256_cvtepi32_ps(x);
+}
+inline V load_f16(const std::uint16_t *p) {
+  __m256i x = _mm256_cvtepu16_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(p)));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(x, 13));
+}
+using M = V;
+inline M less(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline V select(M m, V a, V b) { return _mm256_blendv_ps(b, a, m); }
+inline V gather(const float *p, const std::uint32_t *idx) {
+  return _mm256_i32gather_ps(p, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx)), 4);
+}
+inline V opaque(V v) {
+  asm("" : "+x"(v)); // 与全局的opaque相同，但在本ISA的target区域内实例化，不涉及跨ABI的向量返回
+  return v;
+}
+#include "kernels.inc"
+} // namespace avx2
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+namespace avx512 {
+using V = __m512;
+constexpr std::size_t W = 16;
+constexpr std::size_t IB = 4; // 同时计算的i星体数：32个zmm寄存器放得下4组广播值+累加器
+inline V load(const float *p) { return _mm512_load_ps(p); }
+inline V loadu(const float *p) { return _mm512_loadu_ps(p); }
+inline void store(float *p, V v) { _mm512_store_ps(p, v); }
+inline V set1(float x) { return _mm512_set1_ps(x); }
+inline V zero() { return _mm512_setzero_ps(); }
+inline V add(V a, V b) { return _mm512_add_ps(a, b); }
+inline V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+inline V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+inline V fmadd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+inline V rsqrt(V x) {
+  V y = _mm512_rsqrt14_ps(x); // AVX-512F只有14位精度的版本，迭代一次后足够
+  V xyy = mul(mul(x, y), y);
+  return mul(mul(set1(0.5f), y), sub(set1(3.0f), xyy));
+}
+inline float hsum(V v) { return _mm512_reduce_add_ps(v); }
+using VD = __m512d;
+inline VD zerod() { return _mm512_setzero_pd(); }
+inline VD addd(VD a, VD b) { return _mm512_add_pd(a, b); }
+inline VD widen_lo(V v) { return _mm512_cvtps_pd(_mm512_castps512_ps256(v)); }
+inline VD widen_hi(V v) {
+  return _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+inline double hsumd(VD v) { return _mm512_reduce_add_pd(v); }
+inline V load_q16(const std::int16_t *p) {
+  __m512i x = _mm512_cvtepi16_epi32(_mm256_load_si256(reinterpret_cast<const __m256i *>(p)));
+  return _mm512_cvtepi32_ps(x);
+}
+inline V load_f16(const std::uint16_t *p) {
+  __m512i x = _mm512_cvtepu16_epi32(_mm256_load_si256(reinterpret_cast<const __m256i *>(p)));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(x, 13));
+}
+using M = __mmask16; // AVX-512的比较结果在掩码寄存器里
+inline M less(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+inline V select(M m, V a, V b) { return _mm512_mask_blend_ps(m, b, a); }
+inline V gather(const float *p, const std::uint32_t *idx) {
+  return _mm512_i32gather_ps(_mm512_loadu_si512(idx), p, 4);
+}
+inline V opaque(V v) {
+  asm("" : "+x"(v)); // 与全局的opaque相同，但在本ISA的target区域内实例化，不涉及跨ABI的向量返回
+  return v;
+}
+#include "kernels.inc"
+} // namespace avx512
+#pragma GCC pop_options
+
+enum class Isa { Scalar, SSE, AVX2, AVX512 };
+
+const char *isa_name(Isa isa) {
+  switch (isa) {
+  case Isa::Scalar: return "scalar";
+  case Isa::SSE: return "sse";
+  case Isa::AVX2: return "avx2";
+  case Isa::AVX512: return "avx512";
+  }
+  return "?";
+}
+
+/**
+ * @brief 检测CPU支持的最高ISA，HW04_ISA环境变量可以把它降下来
+ */
+Isa detect_isa() {
+  __builtin_cpu_init();
+  Isa best = Isa::SSE; // x86-64基线保证有SSE2
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    best = Isa::AVX2;
+  if (__builtin_cpu_supports("avx512f"))
+    best = Isa::AVX512;
+  if (const char *env = std::getenv("HW04_ISA")) {
+    for (Isa isa : {Isa::Scalar, Isa::SSE, Isa::AVX2, Isa::AVX512})
+      if (std::strcmp(env, isa_name(isa)) == 0 && isa <= best)
+        return isa;
+  }
+  return best;
+}
+
+/**
+ * @brief 引力计算方式
+ *
+ * Full：每个i遍历全部j（默认，分块直接求和）
+ * Symmetric：每对只算一次，相反的增量同时加到i和j上，rsqrt次数减半
+ * Tree：Barnes-Hut八叉树近似，O(N log N)，与ISA无关（见step_tree）
+ * Fmm：快速多极子方法，O(N)，与ISA无关（见step_fmm）
+ * Compressed：与Full相同的直接求和，j侧读压缩布局（见PackedStars），误差见启动时的报告
+ * Cutoff：只在r_c之内的短程截断引力，邻居表上O(N·k)（见NeighborList）
+ */
+enum class ForceMode { Full, Symmetric, Tree, Fmm, Compressed, Cutoff };
+
+const char *force_mode_name(ForceMode mode) {
+  switch (mode) {
+  case ForceMode::Full: return "full";
+  case ForceMode::Symmetric: return "symmetric";
+  case ForceMode::Tree: return "tree";
+  case ForceMode::Fmm: return "fmm";
+  case ForceMode::Compressed: return "compressed";
+  case ForceMode::Cutoff: return "cutoff";
+  }
+  return "?";
+}
+
+/**
+ * @brief 默认Full，环境变量HW04_FORCE=symmetric|tree|fmm|compressed|cutoff切换引力计算方式
+ */
+ForceMode detect_force_mode() {
+  if (const char *env = std::getenv("HW04_FORCE")) {
+    for (ForceMode mode : {ForceMode::Full, ForceMode::Symmetric, ForceMode::Tree, ForceMode::Fmm,
+                           ForceMode::Compressed, ForceMode::Cutoff})
+      if (std::strcmp(env, force_mode_name(mode)) == 0)
+        return mode;
+  }
+  return ForceMode::Full;
+}
+
+/*
+✅ Barnes-Hut八叉树（HW04_FORCE=tree，生产规模用，作业的main仍然是O(n²)）：
+
+ * 每步从SOA数组重建一棵八叉树：先按包围立方体量化坐标算Morton码并基数排序，
+   同一个子树的星体在排序后恰好是连续的一段，建树只需在每层按3位Morton码二分切段
+ * 节点放在一个只增不减的节点池(std::vector)里，每步clear()复用，同一节点的子节点连续存放
+ * 排序后的位置和质量另存一份连续数组，叶子内的直接求和是顺序访问
+ * 远处的节点满足 size² < θ² * d² 时用质心近似（单极展开），否则打开；
+   θ由HW04_THETA设置（默认0.5），θ = 0时每个叶子都被打开，退化为直接求和（求和顺序不同，只在舍入误差内一致）
+ * 软化、常数和速度更新公式与step()完全相同，因此calc()的能量检查照常适用
+ * 复杂度O(N log N)，N = 48时没有意义；main_mt中遍历部分按排序后的星体段并行
+ * 配合HW04_REORDER使用时Stars本身已接近Morton顺序，建树时的拷贝和写回速度都是顺序访问
+*/
+constexpr std::size_t TREE_LEAF_SIZE = 8; // 星体数不超过它的节点不再细分
+constexpr int MORTON_LEVELS = 10;         // 每个轴10位，Morton码共30位，树最深10层
+constexpr int TREE_STACK = 8 * MORTON_LEVELS + 8;
+
+struct OctreeNode {
+  float cx, cy, cz, mass;    // 质心与总质量
+  float size;                // 节点立方体的边长
+  std::uint32_t begin, end;  // 排序后的星体区间[begin, end)
+  std::uint32_t child;       // 第一个子节点的下标，0表示叶子（0号是根，不会是子节点）
+  std::uint32_t num_children;
+};
+
+/**
+ * @brief Morton码基数排序的结果及其复用的缓冲区
+ *
+ * 排序后index[k]是第k个星体在Stars中的下标，code[k]是它的30位Morton码，
+ * size是量化用的包围立方体边长。缓冲区只在星体数变多时增长，之后每次调用都不再分配。
+ */
+struct MortonOrder {
+  float size = 0.0f;
+  std::vector<std::uint32_t> code, index;
+  std::vector<std::uint32_t> code_tmp, index_tmp;
+};
+
+/**
+ * @brief 每步重建的八叉树及其复用的缓冲区
+ */
+struct Octree {
+  float theta = 0.5f;
+  std::size_t leaf_size = TREE_LEAF_SIZE;
+  std::vector<OctreeNode> nodes;
+  MortonOrder morton;
+  std::vector<float> x, y, z, m; // 按Morton顺序排列的位置与质量
+};
+
+/**
+ * @brief 进程唯一的八叉树，第一次使用时读取HW04_THETA
+ */
+Octree &octree() {
+  static Octree tree = [] {
+    Octree t;
+    if (const char *env = std::getenv("HW04_THETA")) {
+      float theta = std::strtof(env, nullptr);
+      if (theta >= 0.0f)
+        t.theta = theta;
+    }
+    return t;
+  }();
+  return tree;
+}
+
+/**
+ * @brief 把10位整数的每一位隔两位展开：b9..b0 -> b9 0 0 b8 0 0 ... b0
+ */
+inline std::uint32_t morton_spread(std::uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+/**
+ * @brief 计算真实星体的Morton码，并用LSD基数排序（每趟8位，共4趟）按码排序
+ *
+ * 基数排序是稳定的，码相同的星体保持原来的相对顺序，排序结果是确定的。
+ */
+void morton_order(MortonOrder &mo, Stars const &stars) {
+  const std::uint32_t n = (std::uint32_t)stars.n;
+  float lo[3] = {stars.px[0], stars.py[0], stars.pz[0]}, hi[3] = {lo[0], lo[1], lo[2]};
+  for (std::uint32_t i = 1; i < n; i++) {
+    lo[0] = std::min(lo[0], stars.px[i]), hi[0] = std::max(hi[0], stars.px[i]);
+    lo[1] = std::min(lo[1], stars.py[i]), hi[1] = std::max(hi[1], stars.py[i]);
+    lo[2] = std::min(lo[2], stars.pz[i]), hi[2] = std::max(hi[2], stars.pz[i]);
+  }
+  // 包围立方体边长稍微放大，保证最大的坐标量化后仍小于1024
+  mo.size = std::max({hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2], 1e-30f}) * 1.0001f;
+  const float scale = 1024.0f / mo.size;
+  mo.code.resize(n), mo.index.resize(n), mo.code_tmp.resize(n), mo.index_tmp.resize(n);
+  for (std::uint32_t i = 0; i < n; i++) {
+    auto q = [&](float p, float l) {
+      return std::min<std::uint32_t>((std::uint32_t)((p - l) * scale), 1023);
+    };
+    mo.code[i] = morton_spread(q(stars.px[i], lo[0])) << 2 |
+                 morton_spread(q(stars.py[i], lo[1])) << 1 | morton_spread(q(stars.pz[i], lo[2]));
+    mo.index[i] = i;
+  }
+  // 偶数趟，结果最后回到code/index中；swap只交换指针，不分配
+  for (int shift = 0; shift < 32; shift += 8) {
+    std::uint32_t offset[256] = {};
+    for (std::uint32_t i = 0; i < n; i++)
+      offset[(mo.code[i] >> shift) & 0xff]++;
+    std::uint32_t sum = 0;
+    for (std::uint32_t &o : offset) {
+      std::uint32_t c = o;
+      o = sum;
+      sum += c;
+    }
+    for (std::uint32_t i = 0; i < n; i++) {
+      std::uint32_t k = offset[(mo.code[i] >> shift) & 0xff]++;
+      mo.code_tmp[k] = mo.code[i];
+      mo.index_tmp[k] = mo.index[i];
+    }
+    mo.code.swap(mo.code_tmp);
+    mo.index.swap(mo.index_tmp);
+  }
+}
+
+/**
+ * @brief 建立节点idx的子树：[b, e)已按Morton码排序，且在level层之前的码位都相同
+ */
+void tree_build_node(Octree &t, std::uint32_t idx, std::uint32_t b, std::uint32_t e, int level,
+                     float size) {
+  if (e - b <= t.leaf_size || level == MORTON_LEVELS) {
+    float m = 0.0f, mx = 0.0f, my = 0.0f, mz = 0.0f;
+    for (std::uint32_t k = b; k < e; k++) {
+      m += t.m[k];
+      mx += t.m[k] * t.x[k];
+      my += t.m[k] * t.y[k];
+      mz += t.m[k] * t.z[k];
+    }
+    float inv = m > 0.0f ? 1.0f / m : 0.0f;
+    t.nodes[idx] = {mx * inv, my * inv, mz * inv, m, size, b, e, 0, 0};
+    return;
+  }
+  // 当前层的3位Morton码在[b, e)内单调不减，按它二分切出至多8段
+  const int shift = 3 * (MORTON_LEVELS - 1 - level);
+  std::uint32_t cut[9], count = 0;
+  cut[0] = b;
+  const std::uint32_t *codes = t.morton.code.data();
+  for (std::uint32_t oct = 0; oct < 8; oct++) {
+    const std::uint32_t *hi = std::partition_point(
+        codes + cut[count], codes + e, [&](std::uint32_t c) { return ((c >> shift) & 7) <= oct; });
+    std::uint32_t h = (std::uint32_t)(hi - codes);
+    if (h > cut[count])
+      cut[++count] = h;
+  }
+  // 子节点连续分配；递归会扩充节点池，所以只保存下标
+  const std::uint32_t first = (std::uint32_t)t.nodes.size();
+  t.nodes.resize(first + count);
+  float m = 0.0f, mx = 0.0f, my = 0.0f, mz = 0.0f;
+  for (std::uint32_t c = 0; c < count; c++) {
+    tree_build_node(t, first + c, cut[c], cut[c + 1], level + 1, 0.5f * size);
+    OctreeNode const &ch = t.nodes[first + c];
+    m += ch.mass;
+    mx += ch.mass * ch.cx;
+    my += ch.mass * ch.cy;
+    mz += ch.mass * ch.cz;
+  }
+  float inv = m > 0.0f ? 1.0f / m : 0.0f;
+  t.nodes[idx] = {mx * inv, my * inv, mz * inv, m, size, b, e, first, count};
+}
+
+/**
+ * @brief 从stars的真实星体重建八叉树（幽灵星体质量为0，不进树）
+ */
+void tree_build(Octree &t, Stars const &stars) {
+  const std::uint32_t n = (std::uint32_t)stars.n;
+  morton_order(t.morton, stars);
+  t.x.resize(n), t.y.resize(n), t.z.resize(n), t.m.resize(n);
+  for (std::uint32_t k = 0; k < n; k++) {
+    std::uint32_t i = t.morton.index[k];
+    t.x[k] = stars.px[i];
+    t.y[k] = stars.py[i];
+    t.z[k] = stars.pz[i];
+    t.m[k] = stars.mass[i];
+  }
+  t.nodes.clear();
+  t.nodes.resize(1);
+  tree_build_node(t, 0, 0, n, 0, t.morton.size);
+}
+
+/**
+ * @brief 排序后第[k_begin, k_end)个星体遍历树，把速度增量scale * a / G加到Stars中对应的星体上
+ */
+void tree_kick_range(Octree const &t, Stars &stars, float scale, std::size_t k_begin,
+                     std::size_t k_end) {
+  const float theta2 = t.theta * t.theta;
+  const OctreeNode *nodes = t.nodes.data();
+  for (std::size_t k = k_begin; k < k_end; k++) {
+    const float px = t.x[k], py = t.y[k], pz = t.z[k];
+    float vx = 0.0f, vy = 0.0f, vz = 0.0f;
+    std::uint32_t stack[TREE_STACK];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+      OctreeNode const &node = nodes[stack[--sp]];
+      float dx = node.cx - px, dy = node.cy - py, dz = node.cz - pz;
+      float d2 = dx * dx + dy * dy + dz * dz;
+      if (node.size * node.size < theta2 * d2) {
+        // 足够远：整个节点当作位于质心的一个质点
+        d2 += eps_sqr;
+        d2 *= std::sqrt(d2);
+        float xx = (1 / d2) * scale * node.mass;
+        vx += dx * xx;
+        vy += dy * xx;
+        vz += dz * xx;
+      } else if (node.child == 0) {
+        // 打开的叶子：直接求和，自己与自己的dx = 0，贡献为0
+        for (std::uint32_t j = node.begin; j < node.end; j++) {
+          float ex = t.x[j] - px, ey = t.y[j] - py, ez = t.z[j] - pz;
+          float e2 = ex * ex + ey * ey + ez * ez + eps_sqr;
+          e2 *= std::sqrt(e2);
+          float xx = (1 / e2) * scale * t.m[j];
+          vx += ex * xx;
+          vy += ey * xx;
+          vz += ez * xx;
+        }
+      } else {
+        for (std::uint32_t c = 0; c < node.num_children; c++)
+          stack[sp++] = node.child + c;
+      }
+    }
+    std::uint32_t i = t.morton.index[k];
+    stars.vx[i] += vx;
+    stars.vy[i] += vy;
+    stars.vz[i] += vz;
+  }
+}
+
+/**
+ * @brief ForceMode::Tree的KickFn：重建树、遍历
+ */
+void kick_tree(Stars &stars, float scale) {
+  Octree &t = octree();
+  tree_build(t, stars);
+  tree_kick_range(t, stars, scale, 0, stars.n);
+}
+
+/**
+ * @brief ForceMode::Tree对应的step：重建树、遍历、更新位置
+ */
+void step_tree(Stars &stars) {
+  HW04_PERF_BEGIN(PERF_FORCE);
+  kick_tree(stars, G_dt);
+  HW04_PERF_NEXT(PERF_DRIFT);
+  drift(stars, dt);
+}
+
+template <Precision P = Precision::Float> double step_tree_with_energy(Stars &stars) {
+  double energy = calc<P>(stars);
+  step_tree(stars);
+  return energy;
+}
+
+/*
+✅ 快速多极子方法（HW04_FORCE=fmm，10^7体量级、精度要求高的生产任务用）：
+
+ * 与Barnes-Hut共用Octree/morton_order，换成更大的叶子(FMM_LEAF_SIZE)
+ * 笛卡尔泰勒展开：核函数K(r) = 1/sqrt(r² + eps²)，与step()用的是同一个G和eps软化，
+   K的各阶导数用递推公式直接算出，软化项只是把r²换成r² + eps²
+ * 展开阶数p由HW04_FMM_ORDER设置（默认4，最高FMM_MAX_ORDER），展开系数用double保存
+ * 上行：叶子P2M，内部节点按节点池逆序M2M（子节点下标总是比父节点大）
+ * 双树遍历：两个节点满足 (r_A + r_B) < θ * |c_A - c_B| 时M2L，否则拆开较大的节点，
+   两个叶子都不能再拆时直接求和(P2P)；θ与八叉树共用HW04_THETA
+ * 下行：按节点池顺序L2L，叶子L2P，复杂度O(N)
+ * fmm_accuracy()在抽样的星体上与直接求和（step()的公式，double累加）比较速度增量
+ * 5万体均匀分布时p = 4的相对误差约2e-4，p每加2误差约降一个数量级；main_mt中仍是单线程
+*/
+constexpr std::size_t FMM_LEAF_SIZE = 32;
+constexpr int FMM_MAX_ORDER = 10;
+
+/**
+ * @brief |n| <= p的全部多重指标n = (nx, ny, nz)，按总阶数递增的顺序编号
+ */
+struct FmmTables {
+  struct Index {
+    int x, y, z;
+  };
+  struct Triple {
+    int a, b, ab; // 项a、项b与项a + b的编号，满足|a| + |b| <= p
+  };
+  int order = 0;
+  std::vector<Index> index;
+  std::vector<double> fact;        // n! = nx! * ny! * nz!
+  std::vector<int> lookup;         // (nx, ny, nz) -> 编号
+  std::vector<Triple> triples;     // M2L、M2M、L2L共用
+  std::vector<int> up[3];          // n + e_d的编号，超出阶数时为-1
+  std::vector<int> down[3];        // n - e_d的编号，n_d = 0时为-1
+
+  int terms() const { return (int)index.size(); }
+  int at(int x, int y, int z) const {
+    if (x < 0 || y < 0 || z < 0 || x + y + z > order)
+      return -1;
+    return lookup[(x * (order + 1) + y) * (order + 1) + z];
+  }
+
+  explicit FmmTables(int p = 0) : order(p) {
+    lookup.assign((std::size_t)(p + 1) * (p + 1) * (p + 1), -1);
+    for (int deg = 0; deg <= p; deg++)
+      for (int x = deg; x >= 0; x--)
+        for (int y = deg - x; y >= 0; y--) {
+          int z = deg - x - y;
+          lookup[(x * (p + 1) + y) * (p + 1) + z] = (int)index.size();
+          index.push_back({x, y, z});
+        }
+    auto f = [](int k) {
+      double r = 1.0;
+      for (int i = 2; i <= k; i++)
+        r *= i;
+      return r;
+    };
+    for (Index const &n : index) {
+      fact.push_back(f(n.x) * f(n.y) * f(n.z));
+      up[0].push_back(at(n.x + 1, n.y, n.z));
+      up[1].push_back(at(n.x, n.y + 1, n.z));
+      up[2].push_back(at(n.x, n.y, n.z + 1));
+      down[0].push_back(at(n.x - 1, n.y, n.z));
+      down[1].push_back(at(n.x, n.y - 1, n.z));
+      down[2].push_back(at(n.x, n.y, n.z - 1));
+    }
+    for (int a = 0; a < terms(); a++)
+      for (int b = 0; b < terms(); b++) {
+        int ab = at(index[a].x + index[b].x, index[a].y + index[b].y, index[a].z + index[b].z);
+        if (ab >= 0)
+          triples.push_back({a, b, ab});
+      }
+  }
+
+  /**
+   * @brief out[n] = d^n / n!
+   */
+  void monomials(double dx, double dy, double dz, double *out) const {
+    out[0] = 1.0;
+    for (int t = 1; t < terms(); t++) {
+      Index const &n = index[t];
+      if (n.x > 0)
+        out[t] = out[down[0][t]] * dx / n.x;
+      else if (n.y > 0)
+        out[t] = out[down[1][t]] * dy / n.y;
+      else
+        out[t] = out[down[2][t]] * dz / n.z;
+    }
+  }
+
+  /**
+   * @brief out[n] = D^n K(r)，K(r) = 1/sqrt(r² + eps²)
+   *
+   * 泰勒系数a_n = D^n K / n!满足
+   * |n| s a_n + (2|n| - 1) Σ_i r_i a_{n-e_i} + (|n| - 1) Σ_i a_{n-2e_i} = 0，s = r² + eps²
+   */
+  void derivatives(double rx, double ry, double rz, double *out) const {
+    const double s = rx * rx + ry * ry + rz * rz + (double)eps_sqr;
+    const double r[3] = {rx, ry, rz};
+    out[0] = 1.0 / std::sqrt(s);
+    for (int t = 1; t < terms(); t++) {
+      Index const &n = index[t];
+      const int deg = n.x + n.y + n.z;
+      double sum = 0.0;
+      for (int d = 0; d < 3; d++) {
+        int m1 = down[d][t];
+        if (m1 < 0)
+          continue;
+        sum += (2 * deg - 1) * r[d] * out[m1];
+        int m2 = down[d][m1];
+        if (m2 >= 0)
+          sum += (deg - 1) * out[m2];
+      }
+      out[t] = -sum / (deg * s);
+    }
+    for (int t = 0; t < terms(); t++)
+      out[t] *= fact[t];
+  }
+};
+
+struct Fmm {
+  int order = 4;
+  float theta = 0.5f;
+  Octree tree;
+  FmmTables tab;
+  std::vector<double> multipole, local; // 每个节点terms()个系数
+  std::vector<float> radius;            // 节点内星体到质心的最大距离（上界）
+  std::vector<float> ax, ay, az;        // 按Morton顺序排列的速度增量
+  float scale = G_dt;                   // 速度增量的系数G * h，fmm_compute设置
+};
+
+/**
+ * @brief 进程唯一的FMM引擎，第一次使用时读取HW04_FMM_ORDER和HW04_THETA
+ */
+Fmm &fmm() {
+  static Fmm engine = [] {
+    Fmm f;
+    if (const char *env = std::getenv("HW04_FMM_ORDER")) // 范围已由check_options检查
+      f.order = (int)std::strtol(env, nullptr, 10);
+    f.theta = octree().theta;
+    f.tree.leaf_size = FMM_LEAF_SIZE;
+    f.tab = FmmTables(f.order);
+    return f;
+  }();
+  return engine;
+}
+
+/**
+ * @brief 叶子B中的星体受叶子A中星体的引力，公式与step()相同
+ */
+void fmm_p2p(Fmm &f, OctreeNode const &a, OctreeNode const &b) {
+  Octree const &t = f.tree;
+  for (std::uint32_t i = b.begin; i < b.end; i++) {
+    const float px = t.x[i], py = t.y[i], pz = t.z[i];
+    float vx = 0.0f, vy = 0.0f, vz = 0.0f;
+    for (std::uint32_t j = a.begin; j < a.end; j++) {
+      float dx = t.x[j] - px, dy = t.y[j] - py, dz = t.z[j] - pz;
+      float d2 = dx * dx + dy * dy + dz * dz + eps_sqr;
+      d2 *= std::sqrt(d2);
+      float xx = (1 / d2) * f.scale * t.m[j];
+      vx += dx * xx;
+      vy += dy * xx;
+      vz += dz * xx;
+    }
+    f.ax[i] += vx;
+    f.ay[i] += vy;
+    f.az[i] += vz;
+  }
+}
+
+/**
+ * @brief 源节点A的多极展开转换成目标节点B的局部展开
+ */
+void fmm_m2l(Fmm &f, std::uint32_t a, std::uint32_t b) {
+  OctreeNode const &na = f.tree.nodes[a], &nb = f.tree.nodes[b];
+  const int terms = f.tab.terms();
+  double d[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) * (FMM_MAX_ORDER + 3) / 6];
+  f.tab.derivatives((double)nb.cx - na.cx, (double)nb.cy - na.cy, (double)nb.cz - na.cz, d);
+  const double *m = &f.multipole[(std::size_t)a * terms];
+  double *l = &f.local[(std::size_t)b * terms];
+  // L_l += Σ_k D^{k+l}K(c_B - c_A) M_k
+  for (FmmTables::Triple const &tr : f.tab.triples)
+    l[tr.a] += d[tr.ab] * m[tr.b];
+}
+
+/**
+ * @brief 双树遍历：B是目标，A是源
+ */
+void fmm_traverse(Fmm &f, std::uint32_t a, std::uint32_t b) {
+  OctreeNode const &na = f.tree.nodes[a], &nb = f.tree.nodes[b];
+  float dx = na.cx - nb.cx, dy = na.cy - nb.cy, dz = na.cz - nb.cz;
+  float r = f.radius[a] + f.radius[b];
+  if (a != b && r * r < f.theta * f.theta * (dx * dx + dy * dy + dz * dz)) {
+    fmm_m2l(f, a, b);
+    return;
+  }
+  if (na.child == 0 && nb.child == 0) {
+    fmm_p2p(f, na, nb);
+    return;
+  }
+  // 拆开较大的节点（叶子不能拆）
+  if (nb.child != 0 && (na.child == 0 || f.radius[b] >= f.radius[a])) {
+    for (std::uint32_t c = 0; c < nb.num_children; c++)
+      fmm_traverse(f, a, nb.child + c);
+  } else {
+    for (std::uint32_t c = 0; c < na.num_children; c++)
+      fmm_traverse(f, na.child + c, b);
+  }
+}
+
+/**
+ * @brief 计算所有真实星体的速度增量scale * a / G，结果按Morton顺序存在f.ax/ay/az中
+ */
+void fmm_compute(Fmm &f, Stars const &stars, float scale) {
+  f.scale = scale;
+  Octree &t = f.tree;
+  tree_build(t, stars);
+  const std::size_t nodes = t.nodes.size(), n = stars.n;
+  const int terms = f.tab.terms();
+  FmmTables const &tab = f.tab;
+  f.multipole.assign(nodes * terms, 0.0);
+  f.local.assign(nodes * terms, 0.0);
+  f.radius.assign(nodes, 0.0f);
+  f.ax.assign(n, 0.0f), f.ay.assign(n, 0.0f), f.az.assign(n, 0.0f);
+  double mono[(FMM_MAX_ORDER + 1) * (FMM_MAX_ORDER + 2) * (FMM_MAX_ORDER + 3) / 6];
+  // 上行：P2M与M2M，逆序保证子节点先于父节点
+  for (std::size_t k = nodes; k-- > 0;) {
+    OctreeNode const &node = t.nodes[k];
+    double *m = &f.multipole[k * terms];
+    float r = 0.0f;
+    if (node.child == 0) {
+      for (std::uint32_t j = node.begin; j < node.end; j++) {
+        double sx = (double)t.x[j] - node.cx, sy = (double)t.y[j] - node.cy,
+               sz = (double)t.z[j] - node.cz;
+        tab.monomials(-sx, -sy, -sz, mono);
+        for (int q = 0; q < terms; q++)
+          m[q] += t.m[j] * mono[q];
+        r = std::max(r, (float)std::sqrt(sx * sx + sy * sy + sz * sz));
+      }
+    } else {
+      for (std::uint32_t c = node.child; c < node.child + node.num_children; c++) {
+        OctreeNode const &ch = t.nodes[c];
+        double dx = (double)ch.cx - node.cx, dy = (double)ch.cy - node.cy,
+               dz = (double)ch.cz - node.cz;
+        tab.monomials(-dx, -dy, -dz, mono);
+        const double *mc = &f.multipole[(std::size_t)c * terms];
+        // M_k += Σ_{j+q=k} M^c_j (-d)^q / q!
+        for (FmmTables::Triple const &tr : tab.triples)
+          m[tr.ab] += mc[tr.a] * mono[tr.b];
+        r = std::max(r, (float)std::sqrt(dx * dx + dy * dy + dz * dz) + f.radius[c]);
+      }
+    }
+    f.radius[k] = r;
+  }
+  fmm_traverse(f, 0, 0);
+  // 下行：L2L与L2P，顺序保证父节点先于子节点
+  for (std::size_t k = 0; k < nodes; k++) {
+    OctreeNode const &node = t.nodes[k];
+    const double *l = &f.local[k * terms];
+    if (node.child != 0) {
+      for (std::uint32_t c = node.child; c < node.child + node.num_children; c++) {
+        OctreeNode const &ch = t.nodes[c];
+        tab.monomials((double)ch.cx - node.cx, (double)ch.cy - node.cy,
+                      (double)ch.cz - node.cz, mono);
+        double *lc = &f.local[(std::size_t)c * terms];
+        // L^c_j += Σ_q L_{j+q} e^q / q!
+        for (FmmTables::Triple const &tr : tab.triples)
+          lc[tr.a] += l[tr.ab] * mono[tr.b];
+      }
+      continue;
+    }
+    for (std::uint32_t i = node.begin; i < node.end; i++) {
+      tab.monomials((double)t.x[i] - node.cx, (double)t.y[i] - node.cy,
+                    (double)t.z[i] - node.cz, mono);
+      // ∂φ/∂x_d = Σ_j L_{j+e_d} t^j / j!
+      double g[3] = {0.0, 0.0, 0.0};
+      for (int q = 0; q < terms; q++)
+        for (int d = 0; d < 3; d++)
+          if (tab.up[d][q] >= 0)
+            g[d] += l[tab.up[d][q]] * mono[q];
+      f.ax[i] += (float)(f.scale * g[0]);
+      f.ay[i] += (float)(f.scale * g[1]);
+      f.az[i] += (float)(f.scale * g[2]);
+    }
+  }
+}
+
+/**
+ * @brief ForceMode::Fmm的KickFn
+ */
+void kick_fmm(Stars &stars, float scale) {
+  Fmm &f = fmm();
+  fmm_compute(f, stars, scale);
+  const std::uint32_t *index = f.tree.morton.index.data();
+  for (std::size_t k = 0; k < stars.n; k++) {
+    stars.vx[index[k]] += f.ax[k];
+    stars.vy[index[k]] += f.ay[k];
+    stars.vz[index[k]] += f.az[k];
+  }
+}
+
+/**
+ * @brief ForceMode::Fmm对应的step
+ */
+void step_fmm(Stars &stars) {
+  HW04_PERF_BEGIN(PERF_FORCE);
+  kick_fmm(stars, G_dt);
+  HW04_PERF_NEXT(PERF_DRIFT);
+  drift(stars, dt);
+}
+
+double step_fmm_with_energy(Stars &stars) {
+  double energy = calc(stars);
+  step_fmm(stars);
+  return energy;
+}
+
+struct FmmAccuracy {
+  std::size_t samples;
+  double rms, max; // 速度增量的相对误差：均方根与最大值
+};
+
+/**
+ * @brief 在均匀抽取的samples个星体上比较FMM与直接求和，每个抽样星体O(N)
+ */
+FmmAccuracy fmm_accuracy(Stars const &stars, std::size_t samples) {
+  Fmm &f = fmm();
+  fmm_compute(f, stars, G_dt);
+  // Morton顺序下第k个星体 -> 原数组下标，反过来查找抽样星体在ax中的位置
+  std::vector<std::uint32_t> where(stars.n);
+  for (std::size_t k = 0; k < stars.n; k++)
+    where[f.tree.morton.index[k]] = (std::uint32_t)k;
+  samples = std::max<std::size_t>(1, std::min(samples, stars.n));
+  const std::size_t stride = stars.n / samples;
+  double err2 = 0.0, ref2 = 0.0, max = 0.0;
+  for (std::size_t s = 0; s < samples; s++) {
+    std::size_t i = s * stride;
+    double vx = 0.0, vy = 0.0, vz = 0.0;
+    for (std::size_t j = 0; j < stars.n; j++) {
+      double dx = stars.px[j] - stars.px[i], dy = stars.py[j] - stars.py[i],
+             dz = stars.pz[j] - stars.pz[i];
+      double d2 = dx * dx + dy * dy + dz * dz + eps_sqr;
+      double xx = G_dt * stars.mass[j] / (d2 * std::sqrt(d2));
+      vx += dx * xx;
+      vy += dy * xx;
+      vz += dz * xx;
+    }
+    std::size_t k = where[i];
+    double ex = f.ax[k] - vx, ey = f.ay[k] - vy, ez = f.az[k] - vz;
+    double e2 = ex * ex + ey * ey + ez * ez, r2 = vx * vx + vy * vy + vz * vz;
+    err2 += e2;
+    ref2 += r2;
+    max = std::max(max, std::sqrt(e2 / r2));
+  }
+  return {samples, std::sqrt(err2 / ref2), max};
+}
+
+/**
+ * @brief 压缩布局相对double参考的误差，同时给出float布局的分块核（参考step()的SIMD版本）作对照
+ *
+ * 两种核各对全部星体算一遍速度增量（O(N²)），只在均匀抽取的samples个星体上与double比较。
+ */
+struct CompressedAccuracy {
+  std::size_t samples;
+  double rms, max;             // 压缩布局
+  double float_rms, float_max; // 原始float布局的分块核
+};
+
+CompressedAccuracy compressed_accuracy(Stars const &stars, Isa isa, std::size_t samples) {
+  using ForceFn = void (*)(Stars const &, float, float *, float *, float *, TileConfig const &);
+  using PackedFn = double (*)(Stars const &, PackedStars const &, float, float *, float *, float *,
+                              TileConfig const &);
+  PackedFn packed = isa == Isa::AVX512 ? avx512::force_packed<false>
+                    : isa == Isa::AVX2 ? avx2::force_packed<false>
+                                       : sse::force_packed<false>;
+  ForceFn reference = isa == Isa::AVX512 ? avx512::force_tiled
+                      : isa == Isa::AVX2 ? avx2::force_tiled
+                                         : sse::force_tiled;
+  const std::size_t n = stars.padded;
+  std::vector<float> a(6 * n, 0.0f);
+  pack(stars, packed_stars());
+  packed(stars, packed_stars(), G_dt, &a[0], &a[n], &a[2 * n], tile_config());
+  reference(stars, G_dt, &a[3 * n], &a[4 * n], &a[5 * n], tile_config());
+  samples = std::max<std::size_t>(1, std::min(samples, stars.n));
+  const std::size_t stride = stars.n / samples;
+  double err2[2] = {}, ref2 = 0.0, max[2] = {};
+  for (std::size_t s = 0; s < samples; s++) {
+    std::size_t i = s * stride;
+    double vx = 0.0, vy = 0.0, vz = 0.0;
+    for (std::size_t j = 0; j < stars.n; j++) {
+      double dx = stars.px[j] - stars.px[i], dy = stars.py[j] - stars.py[i],
+             dz = stars.pz[j] - stars.pz[i];
+      double d2 = dx * dx + dy * dy + dz * dz + eps_sqr;
+      double xx = G_dt * stars.mass[j] / (d2 * std::sqrt(d2));
+      vx += dx * xx;
+      vy += dy * xx;
+      vz += dz * xx;
+    }
+    const double r2 = vx * vx + vy * vy + vz * vz;
+    ref2 += r2;
+    for (int k = 0; k < 2; k++) {
+      double ex = a[(3 * k) * n + i] - vx, ey = a[(3 * k + 1) * n + i] - vy,
+             ez = a[(3 * k + 2) * n + i] - vz;
+      double e2 = ex * ex + ey * ey + ez * ez;
+      err2[k] += e2;
+      max[k] = std::max(max[k], std::sqrt(e2 / r2));
+    }
+  }
+  return {samples, std::sqrt(err2[0] / ref2), max[0], std::sqrt(err2[1] / ref2), max[1]};
+}
+
+/*
+✅ 按空间填充曲线重排星体（HW04_REORDER=K）：
+
+ * init()产生的星体顺序是随机的，空间上相邻的星体在数组里相距很远，
+   分块核函数的同一个j块、八叉树的同一个叶子都会访问分散的内存
+ * 每K步按Morton码（与八叉树共用morton_order）把七个SOA数组一起重排，相邻的星体落在相邻的缓存行
+ * 排序用基数排序，所有缓冲区在BodyOrder中一次分配，之后每次重排都不再分配
+ * BodyOrder::id记录每个位置上星体的原始编号，restore_order()把所有数组按原始编号放回，
+   输出结果前调用，报告的始终是原始编号下的星体
+ * 直接求和的结果与顺序无关（仅舍入不同），星体之间位置交换不影响能量
+*/
+struct BodyOrder {
+  MortonOrder morton;
+  std::vector<std::uint32_t> id;  // id[k]：当前第k个位置上星体的原始编号
+  std::vector<std::uint32_t> id_tmp;
+  std::vector<float> tmp;
+
+  explicit BodyOrder(std::size_t n) : id(n), id_tmp(n), tmp(n) {
+    for (std::size_t k = 0; k < n; k++)
+      id[k] = (std::uint32_t)k;
+  }
+};
+
+/**
+ * @brief 把stars的七个数组按Morton顺序重排，幽灵星体[n, padded)保持不动
+ */
+void reorder(Stars &stars, BodyOrder &order) {
+  morton_order(order.morton, stars);
+  const std::uint32_t *index = order.morton.index.data();
+  const std::size_t n = stars.n;
+  float *tmp = order.tmp.data();
+  for (float *a : {stars.px, stars.py, stars.pz, stars.vx, stars.vy, stars.vz, stars.mass}) {
+    for (std::size_t k = 0; k < n; k++)
+      tmp[k] = a[index[k]];
+    std::memcpy(a, tmp, n * sizeof(float));
+  }
+  for (std::size_t k = 0; k < n; k++)
+    order.id_tmp[k] = order.id[index[k]];
+  order.id.swap(order.id_tmp);
+  neighbor_list().valid = false;
+}
+
+/**
+ * @brief 把stars恢复到原始编号的顺序，之后id重新是恒等排列
+ */
+void restore_order(Stars &stars, BodyOrder &order) {
+  const std::uint32_t *id = order.id.data();
+  const std::size_t n = stars.n;
+  float *tmp = order.tmp.data();
+  for (float *a : {stars.px, stars.py, stars.pz, stars.vx, stars.vy, stars.vz, stars.mass}) {
+    for (std::size_t k = 0; k < n; k++)
+      tmp[id[k]] = a[k];
+    std::memcpy(a, tmp, n * sizeof(float));
+  }
+  for (std::size_t k = 0; k < n; k++)
+    order.id[k] = (std::uint32_t)k;
+  neighbor_list().valid = false;
+}
+
+/*
+✅ 二进制快照流（HW04_SNAPSHOT=文件名，HW04_SNAPSHOT_EVERY=K）：
+
+ * 每K步把px/py/pz/vx/vy/vz/mass按SOA顺序追加到一个mmap映射的文件，文件开头是固定的SnapshotHeader
+ * 每帧是一个SnapshotFrame（步数与时刻）后面跟7个长度为n的float数组，帧长固定，第k帧的偏移可以直接算出
+ * 时间步循环只把七个数组拷贝到双缓冲中空闲的一块（O(N)的memcpy），后台I/O线程负责写进映射区，
+   写完一帧的数据之后才更新header.frames，并发读取的程序只会看到完整的帧
+ * 映射区按帧数翻倍扩展（ftruncate + mremap），关闭时截断到实际长度
+ * 只有两块缓冲都还没写完时才会等待，次数记在stalls()里；开启重排时按原始编号写出
+*/
+struct SnapshotHeader {
+  char magic[8];               // "HW04SNAP"
+  std::uint32_t version;       // SNAPSHOT_VERSION
+  std::uint32_t arrays;        // Stars::NUM_ARRAYS
+  std::uint64_t n;             // 每帧的星体数
+  std::uint64_t frame_bytes;   // 每帧字节数 = sizeof(SnapshotFrame) + 7 * n * sizeof(float)
+  std::uint64_t frames;        // 已经完整写入的帧数
+  float G, eps, dt;            // 生成快照时的常数与步长
+  std::uint32_t reserved[3];
+};
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header is one cache line");
+
+struct SnapshotFrame {
+  std::int64_t step;
+  double time;
+};
+
+constexpr char SNAPSHOT_MAGIC[8] = {'H', 'W', '0', '4', 'S', 'N', 'A', 'P'};
+constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+class SnapshotWriter {
+public:
+  SnapshotWriter(const char *path, std::size_t n, float h)
+      : n_(n), frame_bytes_(sizeof(SnapshotFrame) + Stars::NUM_ARRAYS * n * sizeof(float)),
+        arena_(2 * Stars::NUM_ARRAYS * Arena::round_up(n, SIMD_WIDTH) * sizeof(float)) {
+    for (Buffer &b : buf_)
+      b.data = arena_.take(Stars::NUM_ARRAYS * Arena::round_up(n, SIMD_WIDTH));
+    fd_ = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0 || !grow(16)) {
+      std::fprintf(stderr, "snapshot: cannot map %s: %s\n", path, std::strerror(errno));
+      return;
+    }
+    SnapshotHeader *hdr = header();
+    std::memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof hdr->magic);
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->arrays = Stars::NUM_ARRAYS;
+    hdr->n = n;
+    hdr->frame_bytes = frame_bytes_;
+    hdr->frames = 0;
+    hdr->G = G, hdr->eps = eps, hdr->dt = h;
+    thread_ = std::thread([this] { writer_loop(); });
+  }
+
+  ~SnapshotWriter() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
+    }
+    if (map_) {
+      std::size_t used = sizeof(SnapshotHeader) + frames_ * frame_bytes_;
+      msync(map_, used, MS_SYNC);
+      munmap(map_, mapped_);
+      if (ftruncate(fd_, (off_t)used) != 0)
+        std::fprintf(stderr, "snapshot: truncate failed: %s\n", std::strerror(errno));
+    }
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+
+  SnapshotWriter(SnapshotWriter const &) = delete;
+  SnapshotWriter &operator=(SnapshotWriter const &) = delete;
+
+  bool ok() const { return thread_.joinable(); }
+  long stalls() const { return stalls_; }
+  std::uint64_t frames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return frames_ + (buf_[0].pending ? 1 : 0) + (buf_[1].pending ? 1 : 0);
+  }
+
+  /**
+   * @brief 把当前状态拷贝进空闲的缓冲区并交给I/O线程；order非空时按原始编号写出
+   */
+  void capture(Stars const &s, long step, double time, BodyOrder const *order = nullptr) {
+    Buffer &b = buf_[next_capture_];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (b.pending) {
+        stalls_++;
+        cv_.wait(lock, [&] { return !b.pending; });
+      }
+    }
+    float const *src[Stars::NUM_ARRAYS] = {s.px, s.py, s.pz, s.vx, s.vy, s.vz, s.mass};
+    for (std::size_t a = 0; a < Stars::NUM_ARRAYS; a++) {
+      float *dst = b.data + a * n_;
+      if (order)
+        for (std::size_t k = 0; k < n_; k++)
+          dst[order->id[k]] = src[a][k];
+      else
+        std::memcpy(dst, src[a], n_ * sizeof(float));
+    }
+    b.frame = {step, time};
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      b.pending = true;
+    }
+    cv_.notify_all();
+    next_capture_ ^= 1;
+  }
+
+private:
+  struct Buffer {
+    float *data = nullptr;
+    SnapshotFrame frame{};
+    bool pending = false;
+  };
+
+  SnapshotHeader *header() { return reinterpret_cast<SnapshotHeader *>(map_); }
+
+  /**
+   * @brief 把文件和映射区扩展到能放下capacity帧
+   */
+  bool grow(std::uint64_t capacity) {
+    std::size_t bytes = sizeof(SnapshotHeader) + capacity * frame_bytes_;
+    if (ftruncate(fd_, (off_t)bytes) != 0)
+      return false;
+    void *p = map_ ? mremap(map_, mapped_, bytes, MREMAP_MAYMOVE)
+                   : mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+      return false;
+    map_ = static_cast<char *>(p);
+    mapped_ = bytes;
+    capacity_ = capacity;
+    return true;
+  }
+
+  void writer_loop() {
+    int next = 0;
+    for (;;) {
+      Buffer &b = buf_[next];
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return b.pending || stop_; });
+        if (!b.pending)
+          return;
+      }
+      if (frames_ == capacity_ && !grow(2 * capacity_)) {
+        std::fprintf(stderr, "snapshot: cannot grow file: %s\n", std::strerror(errno));
+        std::lock_guard<std::mutex> lock(mutex_);
+        b.pending = false;
+        cv_.notify_all();
+        continue;
+      }
+      char *dst = map_ + sizeof(SnapshotHeader) + frames_ * frame_bytes_;
+      std::memcpy(dst, &b.frame, sizeof b.frame);
+      std::memcpy(dst + sizeof b.frame, b.data, Stars::NUM_ARRAYS * n_ * sizeof(float));
+      // 数据写完之后才发布新的帧数
+      __atomic_store_n(&header()->frames, frames_ + 1, __ATOMIC_RELEASE);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frames_++;
+        b.pending = false;
+      }
+      cv_.notify_all();
+      next ^= 1;
+    }
+  }
+
+  std::size_t n_;
+  std::size_t frame_bytes_;
+  Arena arena_;
+  Buffer buf_[2];
+  int next_capture_ = 0;
+  int fd_ = -1;
+  char *map_ = nullptr;
+  std::size_t mapped_ = 0;
+  std::uint64_t capacity_ = 0, frames_ = 0;
+  long stalls_ = 0;
+  bool stop_ = false;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+/*
+✅ 检查点与重启（HW04_CHECKPOINT=文件名，HW04_CHECKPOINT_EVERY=K，HW04_RESTART=文件名）：
+
+ * 每K步把完整的Stars（七个补齐后的数组，含幽灵星体）、步数和frand()的状态写成一个检查点
+ * 检查点先写到 文件名.tmp，fsync之后rename覆盖，被抢占时磁盘上总有一个完整的旧检查点；
+   rename之后再fsync所在目录，否则掉电后目录项可能还指向旧文件，甚至两个名字都不在
+ * 文件布局：128字节的CheckpointHeader，之后七个数组首尾相接，每个都是64字节对齐的
+ * 重启时mmap整个文件(MAP_PRIVATE)，Stars的七个指针直接指向映射的页，不拷贝；
+   写时复制保证模拟过程不会改动检查点文件，没被写过的页（比如mass）一直与页缓存共享
+ * header_checksum总是校验；data_checksum要读遍所有页，HW04_CHECKPOINT_VERIFY=0时跳过以获得毫秒级重启
+ * 开启重排时按原始编号写出，重启后从恒等排列开始
+*/
+struct CheckpointHeader {
+  char magic[8];                 // "HW04CKPT"
+  std::uint32_t version;         // CHECKPOINT_VERSION
+  std::uint32_t arrays;          // Stars::NUM_ARRAYS
+  std::uint64_t n, padded;
+  std::int64_t step;             // 下一个要执行的时间步
+  std::uint64_t rng_seed, rng_draws;
+  float G, eps, dt;
+  std::uint32_t reserved;
+  std::uint64_t data_checksum;   // 七个数组的校验和
+  std::uint64_t header_checksum; // 本结构的校验和，计算时本字段为0
+  std::uint64_t reserved2[5];
+};
+static_assert(sizeof(CheckpointHeader) == 128, "arrays after the header stay 64-byte aligned");
+
+constexpr char CHECKPOINT_MAGIC[8] = {'H', 'W', '0', '4', 'C', 'K', 'P', 'T'};
+constexpr std::uint32_t CHECKPOINT_VERSION = 1;
+
+/**
+ * @brief 64位校验和：四路独立的乘法-循环移位累加，访存带宽决定速度
+ */
+std::uint64_t checksum64(void const *data, std::size_t bytes, std::uint64_t seed = 0) {
+  constexpr std::uint64_t P1 = 0x9E3779B185EBCA87ull, P2 = 0xC2B2AE3D27D4EB4Full;
+  auto rotl = [](std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  std::uint64_t h[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+  std::size_t i = 0;
+  for (; i + 32 <= bytes; i += 32)
+    for (int l = 0; l < 4; l++) {
+      std::uint64_t w;
+      std::memcpy(&w, p + i + 8 * l, 8);
+      h[l] = rotl(h[l] + w * P2, 31) * P1;
+    }
+  std::uint64_t r = bytes;
+  for (int l = 0; l < 4; l++)
+    r = (r ^ rotl(h[l] * P2, 31) * P1) * P1 + P2;
+  for (; i < bytes; i++)
+    r = rotl(r ^ (p[i] * P1), 11) * P2;
+  r ^= r >> 33;
+  r *= P2;
+  r ^= r >> 29;
+  return r;
+}
+
+std::uint64_t header_checksum(CheckpointHeader h) {
+  h.header_checksum = 0;
+  return checksum64(&h, sizeof h);
+}
+
+/**
+ * @brief fsync文件path所在的目录，让其中的rename落盘
+ */
+bool fsync_parent(const char *path) {
+  const char *slash = std::strrchr(path, '/');
+  std::string dir = !slash ? std::string(".") : slash == path ? std::string("/")
+                                                              : std::string(path, slash);
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return false;
+  bool ok = ::fsync(fd) == 0;
+  return ::close(fd) == 0 && ok;
+}
+
+/**
+ * @brief 把stars写成检查点；order非空时按原始编号写出。失败时返回false，旧检查点保持不变
+ */
+bool write_checkpoint(const char *path, Stars const &s, long step, float h,
+                      BodyOrder const *order = nullptr) {
+  std::vector<float> gathered(order ? s.padded : 0);
+  float const *src[Stars::NUM_ARRAYS] = {s.px, s.py, s.pz, s.vx, s.vy, s.vz, s.mass};
+  CheckpointHeader hdr{};
+  std::memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof hdr.magic);
+  hdr.version = CHECKPOINT_VERSION;
+  hdr.arrays = Stars::NUM_ARRAYS;
+  hdr.n = s.n, hdr.padded = s.padded;
+  hdr.step = step;
+  hdr.rng_seed = rng_state.seed, hdr.rng_draws = rng_state.draws;
+  hdr.G = G, hdr.eps = eps, hdr.dt = h;
+  // 数组的顺序（可能经过重排）决定了写出的内容，所以先确定每个数组的源，再算校验和
+  auto array = [&](std::size_t a) -> float const * {
+    if (!order)
+      return src[a];
+    for (std::size_t k = 0; k < s.n; k++)
+      gathered[order->id[k]] = src[a][k];
+    return gathered.data();
+  };
+  std::string tmp = std::string(path) + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::fprintf(stderr, "checkpoint: cannot create %s: %s\n", tmp.c_str(), std::strerror(errno));
+    return false;
+  }
+  auto write_all = [&](void const *data, std::size_t bytes, off_t offset) {
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+      ssize_t w = ::pwrite(fd, p, bytes, offset);
+      if (w <= 0)
+        return false;
+      p += w, bytes -= (std::size_t)w, offset += w;
+    }
+    return true;
+  };
+  bool ok = true;
+  const std::size_t array_bytes = s.padded * sizeof(float);
+  std::uint64_t sum = 0;
+  for (std::size_t a = 0; a < Stars::NUM_ARRAYS && ok; a++) {
+    float const *data = array(a);
+    sum = checksum64(data, array_bytes, sum);
+    ok = write_all(data, array_bytes, (off_t)(sizeof hdr + a * array_bytes));
+  }
+  hdr.data_checksum = sum;
+  hdr.header_checksum = header_checksum(hdr);
+  ok = ok && write_all(&hdr, sizeof hdr, 0) && ::fsync(fd) == 0;
+  ok = ::close(fd) == 0 && ok;
+  ok = ok && std::rename(tmp.c_str(), path) == 0 && fsync_parent(path);
+  if (!ok)
+    std::fprintf(stderr, "checkpoint: cannot write %s: %s\n", path, std::strerror(errno));
+  return ok;
+}
+
+/**
+ * @brief 从检查点恢复：映射整个文件，返回的Stars直接指向映射的页
+ *
+ * 文件损坏、版本或常数不符时打印原因并返回空指针；成功时step、h是写检查点时的值，
+ * frand()的状态也一并恢复。
+ */
+std::unique_ptr<Stars> load_checkpoint(const char *path, long *step, float *h, bool verify) {
+  auto fail = [&](const char *why) {
+    std::fprintf(stderr, "restart: %s: %s\n", path, why);
+    return std::unique_ptr<Stars>();
+  };
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return fail(std::strerror(errno));
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(CheckpointHeader)) {
+    ::close(fd);
+    return fail("file too short");
+  }
+  const std::size_t bytes = (std::size_t)st.st_size;
+  void *map = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+    return fail(std::strerror(errno));
+  std::shared_ptr<void> mapping(map, [bytes](void *p) { ::munmap(p, bytes); });
+  CheckpointHeader const &hdr = *static_cast<CheckpointHeader const *>(map);
+  if (std::memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof hdr.magic) != 0)
+    return fail("not a checkpoint");
+  if (hdr.header_checksum != header_checksum(hdr))
+    return fail("header checksum mismatch");
+  if (hdr.version != CHECKPOINT_VERSION || hdr.arrays != Stars::NUM_ARRAYS)
+    return fail("unsupported version");
+  if (hdr.n == 0 || hdr.padded != Arena::round_up(hdr.n, SIMD_WIDTH) ||
+      bytes != sizeof hdr + Stars::NUM_ARRAYS * hdr.padded * sizeof(float))
+    return fail("size does not match header");
+  if (hdr.G != G || hdr.eps != eps)
+    return fail("written with different G/eps");
+  float *base = reinterpret_cast<float *>(static_cast<char *>(map) + sizeof hdr);
+  if (verify) {
+    std::uint64_t sum = 0;
+    for (std::size_t a = 0; a < Stars::NUM_ARRAYS; a++)
+      sum = checksum64(base + a * hdr.padded, hdr.padded * sizeof(float), sum);
+    if (sum != hdr.data_checksum)
+      return fail("data checksum mismatch");
+  }
+  *step = (long)hdr.step;
+  *h = hdr.dt;
+  rng_restore({hdr.rng_seed, hdr.rng_draws});
+  return std::unique_ptr<Stars>(new Stars((std::size_t)hdr.n, base, std::move(mapping)));
+}
+
+/**
+ * @brief 单调时钟，纳秒
+ */
+inline std::int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/*
+✅ 异步的在线分析（HW04_ANALYSIS_EVERY=K，HW04_ANALYSIS=CSV文件名）：
+
+ * 每K步在两步之间把Stars拷贝进一个空闲的快照槽，交给独立的分析线程池，模拟线程立刻继续下一步
+ * 快照槽写入之后只读：同一帧的几项分析（能量、动量/质心/角动量、径向密度分布）作为独立任务
+   共享这一份拷贝，最后一个任务结束时槽才回到空闲列表（shared_ptr的删除器负责归还）
+ * 槽的数量(HW04_ANALYSIS_DEPTH，默认4)就是在途帧数的上限；没有空闲槽时直接丢弃这一帧并计数，
+   模拟线程永远不等待分析
+ * 背压指标：提交/丢弃帧数、最大在途帧数、从拷贝到最后一项分析完成的延迟，结束时输出
+ * 能量用double的calc_range（含自能项，与calc()一致），O(N²)但不在模拟的关键路径上
+ * 分析线程数HW04_ANALYSIS_THREADS，默认2；main_mt中它们与计算线程共享CPU
+*/
+constexpr int ANALYSIS_BINS = 16;           // 径向密度分布的对数分箱数
+constexpr double ANALYSIS_R_MIN = 1e-2, ANALYSIS_R_MAX = 1e2;
+
+struct AnalysisResult {
+  long step = 0;
+  double energy = 0.0;
+  double momentum[3] = {}, com[3] = {}, angular[3] = {}; // 角动量相对坐标原点
+  double density[ANALYSIS_BINS] = {};                     // 以质心为中心的球壳质量密度
+};
+
+class Analyzer {
+public:
+  Analyzer(std::size_t n, std::size_t depth, unsigned threads) {
+    for (std::size_t k = 0; k < std::max<std::size_t>(depth, 1); k++) {
+      slots_.emplace_back(new Frame(n));
+      free_.push_back(slots_.back().get());
+    }
+    for (unsigned t = 0; t < std::max(threads, 1u); t++)
+      workers_.emplace_back([this] { worker_loop(); });
+  }
+
+  ~Analyzer() { finish(); }
+
+  Analyzer(Analyzer const &) = delete;
+  Analyzer &operator=(Analyzer const &) = delete;
+
+  /**
+   * @brief 模拟线程调用：有空闲槽就拷贝并提交这一帧，否则丢弃，不会阻塞
+   */
+  void capture(Stars const &s, long step) {
+    Frame *f;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      submitted_++;
+      if (free_.empty()) {
+        dropped_++;
+        return;
+      }
+      f = free_.back();
+      free_.pop_back();
+      max_in_flight_ = std::max(max_in_flight_, slots_.size() - free_.size());
+    }
+    // 七个数组首尾相接，一次拷贝
+    std::memcpy(f->stars.px, s.px, Stars::NUM_ARRAYS * s.padded * sizeof(float));
+    f->result = AnalysisResult{};
+    f->result.step = step;
+    f->t_capture = now_ns();
+    std::shared_ptr<Frame> shared(f, Recycle{this});
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (int kind = 0; kind < NUM_TASKS; kind++)
+        tasks_.push_back({shared, kind});
+    }
+    cv_.notify_all();
+  }
+
+  /**
+   * @brief 等所有已提交的帧分析完，停止线程；之后results()按步数排好序
+   */
+  void finish() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread &t : workers_)
+      if (t.joinable())
+        t.join();
+    std::sort(results_.begin(), results_.end(),
+              [](AnalysisResult const &a, AnalysisResult const &b) { return a.step < b.step; });
+  }
+
+  std::vector<AnalysisResult> const &results() const { return results_; }
+  long submitted() const { return submitted_; }
+  long dropped() const { return dropped_; }
+  std::size_t max_in_flight() const { return max_in_flight_; }
+  double mean_latency_ms() const {
+    return results_.empty() ? 0.0 : latency_sum_ns_ * 1e-6 / (double)results_.size();
+  }
+  double max_latency_ms() const { return (double)latency_max_ns_ * 1e-6; }
+
+  /**
+   * @brief 写CSV：每帧一行，最后以注释行给出背压指标
+   */
+  bool write_csv(const char *path) const {
+    FILE *f = std::fopen(path, "w");
+    if (!f) {
+      std::fprintf(stderr, "analysis: cannot open %s: %s\n", path, std::strerror(errno));
+      return false;
+    }
+    std::fprintf(f, "step,energy,px,py,pz,comx,comy,comz,lx,ly,lz");
+    for (int b = 0; b < ANALYSIS_BINS; b++)
+      std::fprintf(f, ",rho%d", b);
+    std::fprintf(f, "\n");
+    for (AnalysisResult const &r : results_) {
+      std::fprintf(f, "%ld,%.17g", r.step, r.energy);
+      for (double const *v : {r.momentum, r.com, r.angular})
+        std::fprintf(f, ",%.17g,%.17g,%.17g", v[0], v[1], v[2]);
+      for (double rho : r.density)
+        std::fprintf(f, ",%.17g", rho);
+      std::fprintf(f, "\n");
+    }
+    std::fprintf(f, "# submitted %ld, dropped %ld, max in flight %zu, latency mean %.3f ms max %.3f ms\n",
+                 submitted_, dropped_, max_in_flight_, mean_latency_ms(), max_latency_ms());
+    return std::fclose(f) == 0;
+  }
+
+private:
+  enum { TASK_ENERGY, TASK_MOMENTS, TASK_DENSITY, NUM_TASKS };
+
+  struct Frame {
+    Stars stars;
+    std::int64_t t_capture = 0;
+    AnalysisResult result; // 各任务只写自己的字段，互不重叠
+    explicit Frame(std::size_t n) : stars(n) {}
+  };
+
+  struct Task {
+    std::shared_ptr<Frame> frame;
+    int kind;
+  };
+
+  struct Recycle {
+    Analyzer *owner;
+    void operator()(Frame *f) const { owner->recycle(f); }
+  };
+
+  void recycle(Frame *f) {
+    const std::int64_t latency = now_ns() - f->t_capture;
+    std::lock_guard<std::mutex> lock(mutex_);
+    results_.push_back(f->result);
+    latency_sum_ns_ += (double)latency;
+    latency_max_ns_ = std::max(latency_max_ns_, latency);
+    free_.push_back(f);
+  }
+
+  void worker_loop() {
+    for (;;) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] { return !tasks_.empty() || stop_; });
+        if (tasks_.empty())
+          return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      run(*task.frame, task.kind);
+      // task析构时释放对帧的引用，最后一个引用归还快照槽
+    }
+  }
+
+  static void run(Frame &f, int kind) {
+    Stars const &s = f.stars;
+    AnalysisResult &r = f.result;
+    if (kind == TASK_ENERGY) {
+      r.energy = calc_range<Precision::Double>(s, 0, s.n);
+      return;
+    }
+    double m = 0.0, c[3] = {};
+    for (std::size_t i = 0; i < s.n; i++) {
+      m += s.mass[i];
+      c[0] += (double)s.mass[i] * s.px[i];
+      c[1] += (double)s.mass[i] * s.py[i];
+      c[2] += (double)s.mass[i] * s.pz[i];
+    }
+    for (double &x : c)
+      x = m > 0.0 ? x / m : 0.0;
+    if (kind == TASK_MOMENTS) {
+      for (std::size_t i = 0; i < s.n; i++) {
+        const double mi = s.mass[i], x = s.px[i], y = s.py[i], z = s.pz[i];
+        const double vx = s.vx[i], vy = s.vy[i], vz = s.vz[i];
+        r.momentum[0] += mi * vx;
+        r.momentum[1] += mi * vy;
+        r.momentum[2] += mi * vz;
+        r.angular[0] += mi * (y * vz - z * vy);
+        r.angular[1] += mi * (z * vx - x * vz);
+        r.angular[2] += mi * (x * vy - y * vx);
+      }
+      std::copy(c, c + 3, r.com);
+      return;
+    }
+    // TASK_DENSITY：半径的对数等分，范围外的星体不计入
+    const double lmin = std::log(ANALYSIS_R_MIN), width = std::log(ANALYSIS_R_MAX / ANALYSIS_R_MIN);
+    for (std::size_t i = 0; i < s.n; i++) {
+      const double dx = s.px[i] - c[0], dy = s.py[i] - c[1], dz = s.pz[i] - c[2];
+      const double rr = std::sqrt(dx * dx + dy * dy + dz * dz);
+      const int b = rr > 0.0 ? (int)std::floor((std::log(rr) - lmin) / width * ANALYSIS_BINS) : -1;
+      if (b >= 0 && b < ANALYSIS_BINS)
+        r.density[b] += s.mass[i];
+    }
+    for (int b = 0; b < ANALYSIS_BINS; b++) {
+      const double r0 = ANALYSIS_R_MIN * std::exp(width * b / ANALYSIS_BINS);
+      const double r1 = ANALYSIS_R_MIN * std::exp(width * (b + 1) / ANALYSIS_BINS);
+      r.density[b] /= 4.0 / 3.0 * M_PI * (r1 * r1 * r1 - r0 * r0 * r0);
+    }
+  }
+
+  std::vector<std::unique_ptr<Frame>> slots_;
+  std::vector<Frame *> free_;
+  std::deque<Task> tasks_;
+  std::vector<AnalysisResult> results_;
+  long submitted_ = 0, dropped_ = 0;
+  std::size_t max_in_flight_ = 0;
+  double latency_sum_ns_ = 0.0;
+  std::int64_t latency_max_ns_ = 0;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::thread> workers_;
+};
+
+/**
+ * @brief 时间步之间要做的事（重排、快照、检查点、在线分析），单线程循环和run_timesteps共用
+ *
+ * due(i)为true时才会在第i步之前调用run(i)，run_timesteps里只有这种步才多一次屏障。
+ */
+struct BetweenSteps {
+  BodyOrder *order = nullptr;
+  long reorder_every = 0;
+  SnapshotWriter *snapshot = nullptr;
+  long snapshot_every = 0;
+  float h = dt;
+  const char *checkpoint = nullptr;
+  long checkpoint_every = 0;
+  long first = 0; // 起始步（重启时不为0），这一步不再写检查点
+  Analyzer *analysis = nullptr;
+  long analysis_every = 0;
+
+  bool due(long step) const {
+    return (reorder_every > 0 && step % reorder_every == 0) ||
+           (analysis && analysis_every > 0 && step % analysis_every == 0) ||
+           (snapshot && snapshot_every > 0 && step % snapshot_every == 0) ||
+           (checkpoint && checkpoint_every > 0 && step % checkpoint_every == 0 && step != first);
+  }
+
+  void run(Stars &stars, long step) {
+    BodyOrder const *ids = reorder_every > 0 ? order : nullptr;
+    if (reorder_every > 0 && step % reorder_every == 0)
+      reorder(stars, *order);
+    if (snapshot && snapshot_every > 0 && step % snapshot_every == 0)
+      snapshot->capture(stars, step, (double)step * h, ids);
+    if (checkpoint && checkpoint_every > 0 && step % checkpoint_every == 0 && step != first)
+      write_checkpoint(checkpoint, stars, step, h, ids);
+    if (analysis && analysis_every > 0 && step % analysis_every == 0)
+      analysis->capture(stars, step);
+  }
+};
+
+using StepFn = void (*)(Stars &);
+
+template <Precision P> StepFn select_step(Isa isa, ForceMode mode) {
+  if (mode == ForceMode::Tree)
+    return step_tree;
+  if (mode == ForceMode::Fmm)
+    return step_fmm;
+  // 压缩布局总是float，只有SIMD版本，标量用SSE代替
+  if (mode == ForceMode::Compressed)
+    return isa == Isa::AVX512 ? avx512::step_compressed
+           : isa == Isa::AVX2 ? avx2::step_compressed
+                              : sse::step_compressed;
+  if (mode == ForceMode::Cutoff)
+    return isa == Isa::AVX512 ? avx512::step_cutoff
+           : isa == Isa::AVX2 ? avx2::step_cutoff
+                              : sse::step_cutoff;
+  bool sym = mode == ForceMode::Symmetric;
+  // Float的直接求和先看N有没有编译期特化的实例，见step_dispatch
+  const bool fixed = P == Precision::Float;
+  switch (isa) {
+  case Isa::Scalar: return sym ? step_symmetric : step<P>;
+  case Isa::SSE: return sym ? sse::step_symmetric : fixed ? sse::step_dispatch : sse::step<P>;
+  case Isa::AVX2: return sym ? avx2::step_symmetric : fixed ? avx2::step_dispatch : avx2::step<P>;
+  case Isa::AVX512:
+    return sym ? avx512::step_symmetric : fixed ? avx512::step_dispatch : avx512::step<P>;
+  }
+  return step<P>;
+}
+
+StepFn select_step(Isa isa, ForceMode mode, Precision p) {
+  switch (p) {
+  case Precision::Double: return select_step<Precision::Double>(isa, mode);
+  case Precision::Compensated: return select_step<Precision::Compensated>(isa, mode);
+  case Precision::Float: break;
+  }
+  return select_step<Precision::Float>(isa, mode);
+}
+
+using StepEnergyFn = double (*)(Stars &);
+
+/**
+ * @brief 先calc()再执行F，给没有融合能量版本的step用
+ */
+template <StepFn F> double calc_then_step(Stars &stars) {
+  double energy = calc(stars);
+  F(stars);
+  return energy;
+}
+
+/**
+ * @brief 先cutoff_energy()再执行F，截断模式的能量与它的力配对
+ */
+template <StepFn F> double cutoff_then_step(Stars &stars) {
+  double energy = cutoff_energy(stars);
+  F(stars);
+  return energy;
+}
+using EnergyFn = double (*)(Stars const &);
+
+/**
+ * @brief 标量参考：先calc()再step()，与SIMD版本的返回值语义相同
+ */
+template <Precision P = Precision::Float> double step_with_energy(Stars &stars) {
+  double energy = calc<P>(stars);
+  step<P>(stars);
+  return energy;
+}
+
+double step_symmetric_with_energy(Stars &stars) {
+  double energy = calc(stars);
+  step_symmetric(stars);
+  return energy;
+}
+
+template <Precision P> StepEnergyFn select_step_with_energy(Isa isa, ForceMode mode) {
+  if (mode == ForceMode::Tree)
+    return step_tree_with_energy<P>;
+  if (mode == ForceMode::Fmm)
+    return step_fmm_with_energy;
+  if (mode == ForceMode::Compressed)
+    return isa == Isa::AVX512 ? avx512::step_compressed_with_energy
+           : isa == Isa::AVX2 ? avx2::step_compressed_with_energy
+                              : sse::step_compressed_with_energy;
+  // 截断模式没有融合版本，能量是cutoff_energy()的shifted-force势能
+  if (mode == ForceMode::Cutoff)
+    return isa == Isa::AVX512 ? cutoff_then_step<avx512::step_cutoff>
+           : isa == Isa::AVX2 ? cutoff_then_step<avx2::step_cutoff>
+                              : cutoff_then_step<sse::step_cutoff>;
+  bool sym = mode == ForceMode::Symmetric;
+  if (!sym && P == Precision::Float) {
+    switch (isa) {
+    case Isa::SSE: return sse::step_dispatch_with_energy;
+    case Isa::AVX2: return avx2::step_dispatch_with_energy;
+    case Isa::AVX512: return avx512::step_dispatch_with_energy;
+    case Isa::Scalar: break;
+    }
+  }
+  switch (isa) {
+  case Isa::Scalar: return sym ? step_symmetric_with_energy : step_with_energy<P>;
+  case Isa::SSE: return sym ? sse::step_symmetric_with_energy : sse::step_with_energy<P>;
+  case Isa::AVX2: return sym ? avx2::step_symmetric_with_energy : avx2::step_with_energy<P>;
+  case Isa::AVX512: return sym ? avx512::step_symmetric_with_energy : avx512::step_with_energy<P>;
+  }
+  return step_with_energy<P>;
+}
+
+StepEnergyFn select_step_with_energy(Isa isa, ForceMode mode, Precision p) {
+  switch (p) {
+  case Precision::Double: return select_step_with_energy<Precision::Double>(isa, mode);
+  case Precision::Compensated: return select_step_with_energy<Precision::Compensated>(isa, mode);
+  case Precision::Float: break;
+  }
+  return select_step_with_energy<Precision::Float>(isa, mode);
+}
+
+EnergyFn select_calc(Precision p) {
+  switch (p) {
+  case Precision::Double: return calc<Precision::Double>;
+  case Precision::Compensated: return calc<Precision::Compensated>;
+  case Precision::Float: break;
+  }
+  return calc<Precision::Float>;
+}
+
+/**
+ * @brief 与select_step对应的KickFn：只更新速度，引力核与选中模式的step相同
+ */
+template <Precision P> KickFn select_kick(Isa isa, ForceMode mode) {
+  if (mode == ForceMode::Tree)
+    return kick_tree;
+  if (mode == ForceMode::Fmm)
+    return kick_fmm;
+  if (mode == ForceMode::Compressed)
+    return isa == Isa::AVX512 ? avx512::kick_compressed
+           : isa == Isa::AVX2 ? avx2::kick_compressed
+                              : sse::kick_compressed;
+  if (mode == ForceMode::Cutoff)
+    return isa == Isa::AVX512 ? avx512::kick_cutoff
+           : isa == Isa::AVX2 ? avx2::kick_cutoff
+                              : sse::kick_cutoff;
+  bool sym = mode == ForceMode::Symmetric;
+  switch (isa) {
+  case Isa::Scalar: return sym ? kick_symmetric : kick<P>;
+  case Isa::SSE: return sym ? sse::kick_symmetric : sse::kick<P>;
+  case Isa::AVX2: return sym ? avx2::kick_symmetric : avx2::kick<P>;
+  case Isa::AVX512: return sym ? avx512::kick_symmetric : avx512::kick<P>;
+  }
+  return kick<P>;
+}
+
+KickFn select_kick(Isa isa, ForceMode mode, Precision p) {
+  switch (p) {
+  case Precision::Double: return select_kick<Precision::Double>(isa, mode);
+  case Precision::Compensated: return select_kick<Precision::Compensated>(isa, mode);
+  case Precision::Float: break;
+  }
+  return select_kick<Precision::Float>(isa, mode);
+}
+
+using IntegratorFn = void (*)(Stars &, float, KickFn);
+
+template <Integrator I> IntegratorFn select_integrator(Isa isa) {
+  switch (isa) {
+  case Isa::Scalar: return step_integrator<I>;
+  case Isa::SSE: return sse::step_integrator<I>;
+  case Isa::AVX2: return avx2::step_integrator<I>;
+  case Isa::AVX512: return avx512::step_integrator<I>;
+  }
+  return step_integrator<I>;
+}
+
+/**
+ * @brief 输出型引力核只有SIMD版本，标量用SSE代替
+ */
+StepFn select_output_step(Isa isa) {
+  switch (isa) {
+  case Isa::AVX512: return avx512::step_outputs;
+  case Isa::AVX2: return avx2::step_outputs;
+  case Isa::Scalar:
+  case Isa::SSE: break;
+  }
+  return sse::step_outputs;
+}
+
+StepEnergyFn select_output_step_with_energy(Isa isa) {
+  switch (isa) {
+  case Isa::AVX512: return calc_then_step<avx512::step_outputs>;
+  case Isa::AVX2: return calc_then_step<avx2::step_outputs>;
+  case Isa::Scalar:
+  case Isa::SSE: break;
+  }
+  return calc_then_step<sse::step_outputs>;
+}
+
+/**
+ * @brief HW04_OUTPUTS模式的下游示例：整个运行期间距离最近的一对星体，按原始编号记录
+ */
+struct ClosestApproach {
+  float d2 = INFINITY; // 含软化项eps²
+  long step = -1;
+  std::uint32_t a = 0, b = 0;
+
+  void update(ForceOutput const &out, std::size_t n, BodyOrder const &order, long at) {
+    for (std::size_t i = 0; i < n; i++)
+      if (out.min_d2[i] < d2) {
+        d2 = out.min_d2[i];
+        step = at;
+        a = order.id[i];
+        b = order.id[out.nearest[i]];
+      }
+  }
+};
+
+/**
+ * @brief 块时间步只有SIMD版本（与系综模式相同），标量用SSE代替
+ */
+IntegratorFn select_block_step(Isa isa) {
+  switch (isa) {
+  case Isa::AVX512: return avx512::step_block;
+  case Isa::AVX2: return avx2::step_block;
+  case Isa::Scalar:
+  case Isa::SSE: break;
+  }
+  return sse::step_block;
+}
+
+IntegratorFn select_integrator(Isa isa, Integrator integ) {
+  switch (integ) {
+  case Integrator::Block: return select_block_step(isa);
+  case Integrator::Leapfrog: return select_integrator<Integrator::Leapfrog>(isa);
+  case Integrator::Yoshida4: return select_integrator<Integrator::Yoshida4>(isa);
+  case Integrator::Euler: break;
+  }
+  return select_integrator<Integrator::Euler>(isa);
+}
+
+#ifdef HW04_MT
+/*
+✅ 生产环境的多线程版本（main_mt目标，作业用的main仍然是单线程）：
+
+1. 常驻线程池：
+ * 线程在启动时创建并绑定到各自的CPU，整个100000步循环期间不退出，没有每步创建线程的开销
+ * 主线程本身也是0号工作线程
+
+2. 工作窃取：
+ * 每次parallel_for把区间切成若干chunk，按线程轮流放进各自的队列
+ * 线程先从自己的队列头部取，空了再从其他线程队列的尾部偷，负载不均时自动平衡
+
+3. 无伪共享：
+ * 每个chunk都是SIMD_WIDTH(16个float = 64字节)的整数倍且对齐，
+ * 每个chunk只写自己那一段vx/vy/vz，不同线程不会写同一条缓存行
+
+4. 对称模式的j侧写入会落到任意位置，无法按段划分，因此main_mt里对称模式仍然单线程执行
+
+5. 八叉树模式（step_tree_mt）只并行树的遍历，建树O(N log N)相对遍历很小，仍然单线程
+*/
+
+/**
+ * @brief 把当前线程绑定到进程允许的第k个CPU上（按允许集合循环）
+ */
+void pin_current_thread(unsigned k) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+    return;
+  int count = CPU_COUNT(&allowed);
+  if (count <= 0)
+    return;
+  int target = (int)(k % (unsigned)count);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    if (target-- == 0) {
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      pthread_setaffinity_np(pthread_self(), sizeof one, &one);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief 进程允许运行的CPU数（affinity掩码），取不到时用hardware_concurrency
+ */
+unsigned available_cpus() {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof allowed, &allowed) == 0 && CPU_COUNT(&allowed) > 0)
+    return (unsigned)CPU_COUNT(&allowed);
+  unsigned hw = std::thread::hardware_concurrency();
+  return hw ? hw : 1u;
+}
+
+/**
+ * @brief 忙等的一次退避：前64次_mm_pause，之后sched_yield，
+ * 线程数多于CPU时把CPU让给还没完成的线程，而不是一直空转到时间片用完
+ */
+inline void spin_backoff(unsigned &k) {
+  if (k < 64) {
+    k++;
+    _mm_pause();
+  } else {
+    sched_yield();
+  }
+}
+
+/**
+ * @brief 常驻、绑核的工作窃取线程池
+ */
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned threads) : queues_(threads ? threads : 1) {
+    pin_current_thread(0);
+    for (unsigned t = 1; t < queues_.size(); t++)
+      workers_.emplace_back([this, t] { worker_loop(t); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &w : workers_)
+      w.join();
+  }
+
+  unsigned size() const { return (unsigned)queues_.size(); }
+
+  /**
+   * @brief 并行执行f(chunk)，chunk取遍[0, count)，返回时全部完成
+   */
+  template <class F> void parallel_for(std::size_t count, F const &f) {
+    if (count == 0)
+      return;
+    if (size() == 1 || count == 1) {
+      for (std::size_t c = 0; c < count; c++)
+        f(c);
+      return;
+    }
+    // 连续的chunk分给同一个线程，保持每个线程访问的内存连续
+    std::size_t per = (count + size() - 1) / size();
+    for (unsigned t = 0; t < size(); t++) {
+      queues_[t].head = std::min(count, t * per);
+      queues_[t].tail = std::min(count, (t + 1) * per);
+    }
+    remaining_.store(count, std::memory_order_relaxed);
+    run([&](unsigned self) {
+      std::size_t c;
+      while (pop(self, c) || steal(self, c)) {
+        f(c);
+        remaining_.fetch_sub(1, std::memory_order_acq_rel);
+      }
+      unsigned k = 0;
+      while (remaining_.load(std::memory_order_acquire) != 0)
+        spin_backoff(k);
+    });
+  }
+
+  /**
+   * @brief 所有线程（包括主线程）同时执行f(thread_id)，返回时全部完成
+   */
+  template <class F> void run(F const &f) {
+    job_ = [](void const *ctx, unsigned t) { (*static_cast<F const *>(ctx))(t); };
+    job_ctx_ = &f;
+    done_.store(0, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      generation_++;
+    }
+    wake_.notify_all();
+    f(0);
+    unsigned k = 0;
+    while (done_.load(std::memory_order_acquire) != size() - 1)
+      spin_backoff(k);
+  }
+
+private:
+  // 每个线程的chunk队列[head, tail)：自己从head取，别人从tail偷
+  struct alignas(CACHE_LINE) Queue {
+    std::mutex lock;
+    std::size_t head = 0, tail = 0;
+  };
+
+  bool pop(unsigned self, std::size_t &c) {
+    Queue &q = queues_[self];
+    std::lock_guard<std::mutex> lock(q.lock);
+    if (q.head == q.tail)
+      return false;
+    c = q.head++;
+    return true;
+  }
+
+  bool steal(unsigned self, std::size_t &c) {
+    for (unsigned k = 1; k < size(); k++) {
+      Queue &q = queues_[(self + k) % size()];
+      std::lock_guard<std::mutex> lock(q.lock);
+      if (q.head != q.tail) {
+        c = --q.tail;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void worker_loop(unsigned t) {
+    pin_current_thread(t);
+    unsigned long seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_)
+          return;
+        seen = generation_;
+      }
+      job_(job_ctx_, t);
+      done_.fetch_add(1, std::memory_order_acq_rel);
+    }
+  }
+
+  std::vector<Queue> queues_;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  unsigned long generation_ = 0;
+  bool stop_ = false;
+  void (*job_)(void const *, unsigned) = nullptr;
+  void const *job_ctx_ = nullptr;
+  alignas(CACHE_LINE) std::atomic<unsigned> done_{0};
+  alignas(CACHE_LINE) std::atomic<std::size_t> remaining_{0};
+};
+
+/**
+ * @brief 进程内唯一的线程池，线程数取HW04_THREADS，默认为进程允许运行的CPU数
+ *
+ * 不用hardware_concurrency()：cpuset受限的容器里它是整机的核数，线程会按pin_current_thread
+ * 成倍地挤在允许的几个CPU上。
+ */
+ThreadPool &thread_pool() {
+  static ThreadPool pool([] {
+    if (const char *env = std::getenv("HW04_THREADS"))
+      if (unsigned t = (unsigned)std::strtoul(env, nullptr, 10))
+        return t;
+    return available_cpus();
+  }());
+  return pool;
+}
+
+/**
+ * @brief 多线程step用到的分段核函数，按ISA选择
+ */
+struct RangeKernels {
+  double (*kick)(Stars &, float, std::size_t, std::size_t);
+  double (*kick_energy)(Stars &, float, std::size_t, std::size_t);
+  void (*drift)(Stars &, std::size_t, std::size_t);
+  double (*kinetic)(Stars const &, std::size_t, std::size_t);
+};
+
+template <Precision P> RangeKernels select_range_kernels(Isa isa) {
+  switch (isa) {
+  case Isa::AVX512:
+    return {avx512::kick_range<P, false>, avx512::kick_range<P, true>, avx512::drift_range,
+            avx512::kinetic_range<P>};
+  case Isa::AVX2:
+    return {avx2::kick_range<P, false>, avx2::kick_range<P, true>, avx2::drift_range,
+            avx2::kinetic_range<P>};
+  case Isa::Scalar: // 标量参考路径没有分段版本，用SSE代替
+  case Isa::SSE:
+    break;
+  }
+  return {sse::kick_range<P, false>, sse::kick_range<P, true>, sse::drift_range,
+          sse::kinetic_range<P>};
+}
+
+RangeKernels select_range_kernels(Isa isa, Precision p) {
+  switch (p) {
+  case Precision::Double: return select_range_kernels<Precision::Double>(isa);
+  case Precision::Compensated: return select_range_kernels<Precision::Compensated>(isa);
+  case Precision::Float: break;
+  }
+  return select_range_kernels<Precision::Float>(isa);
+}
+
+RangeKernels mt_kernels = select_range_kernels(Isa::SSE, Precision::Float);
+
+/**
+ * @brief 每个chunk的星体数：SIMD_WIDTH的倍数，每个线程大约分到8个chunk以便窃取
+ */
+std::size_t mt_grain(Stars const &s) {
+  std::size_t parts = 8 * (std::size_t)thread_pool().size();
+  std::size_t grain = Arena::round_up((s.padded + parts - 1) / parts, SIMD_WIDTH);
+  return std::max(grain, SIMD_WIDTH);
+}
+
+template <bool Energy> double step_mt_impl(Stars &stars) {
+  ThreadPool &pool = thread_pool();
+  const std::size_t grain = mt_grain(stars);
+  const std::size_t chunks = (stars.padded + grain - 1) / grain;
+  // 不能用scratch()：核函数内部也会用到同一个线程私有缓冲区
+  // lambda里引用thread_local变量会访问执行线程自己的实例，所以先取出指针
+  thread_local std::vector<double> partial_buf;
+  partial_buf.resize(chunks);
+  double *partial = partial_buf.data();
+  // 第一阶段：各chunk用旧位置更新自己那段速度；parallel_for返回就是阶段间的同步点
+  HW04_PERF_BEGIN(PERF_FORCE);
+  pool.parallel_for(chunks, [&](std::size_t c) {
+    std::size_t b = c * grain, e = std::min(b + grain, stars.padded);
+    partial[c] = 0.0;
+    if (Energy)
+      partial[c] = mt_kernels.kinetic(stars, b, e) -
+                   0.5 * G * mt_kernels.kick_energy(stars, G_dt, b, e);
+    else
+      mt_kernels.kick(stars, G_dt, b, e);
+  });
+  // 第二阶段：更新位置
+  HW04_PERF_NEXT(PERF_DRIFT);
+  pool.parallel_for(chunks, [&](std::size_t c) {
+    std::size_t b = c * grain, e = std::min(b + grain, stars.padded);
+    mt_kernels.drift(stars, b, e);
+  });
+  // 按chunk顺序求和，结果与线程数和窃取顺序无关
+  double energy = 0.0;
+  for (std::size_t c = 0; c < chunks; c++)
+    energy += partial[c];
+  return energy;
+}
+
+void step_mt(Stars &stars) { step_mt_impl<false>(stars); }
+double step_mt_with_energy(Stars &stars) { return step_mt_impl<true>(stars); }
+
+/**
+ * @brief 多线程的ForceMode::Full的KickFn：与step_mt的第一阶段相同
+ */
+void kick_mt(Stars &stars, float scale) {
+  const std::size_t grain = mt_grain(stars);
+  thread_pool().parallel_for((stars.padded + grain - 1) / grain, [&](std::size_t c) {
+    std::size_t b = c * grain, e = std::min(b + grain, stars.padded);
+    mt_kernels.kick(stars, scale, b, e);
+  });
+}
+
+/**
+ * @brief 多线程calc()：按chunk并行求和，再按chunk顺序相加
+ */
+template <Precision P> double calc_mt(Stars const &stars) {
+  HW04_PERF_BEGIN(PERF_CALC);
+  const std::size_t grain = mt_grain(stars);
+  const std::size_t chunks = (stars.padded + grain - 1) / grain;
+  std::vector<double> partial(chunks);
+  thread_pool().parallel_for(chunks, [&](std::size_t c) {
+    partial[c] = calc_range<P>(stars, c * grain, (c + 1) * grain);
+  });
+  double energy = 0.0;
+  for (double e : partial)
+    energy += e;
+  return energy;
+}
+
+EnergyFn select_calc_mt(Precision p) {
+  switch (p) {
+  case Precision::Double: return calc_mt<Precision::Double>;
+  case Precision::Compensated: return calc_mt<Precision::Compensated>;
+  case Precision::Float: break;
+  }
+  return calc_mt<Precision::Float>;
+}
+
+/**
+ * @brief 多线程的ForceMode::Tree的KickFn：建树仍是单线程，遍历按排序后的星体段并行
+ *
+ * 每个星体只被一个chunk写入，不同线程写的是不同星体，结果与线程数无关。
+ */
+void kick_tree_mt(Stars &stars, float scale) {
+  Octree &t = octree();
+  tree_build(t, stars);
+  const std::size_t grain = mt_grain(stars);
+  thread_pool().parallel_for((stars.n + grain - 1) / grain, [&](std::size_t c) {
+    tree_kick_range(t, stars, scale, c * grain, std::min((c + 1) * grain, stars.n));
+  });
+}
+
+void step_tree_mt(Stars &stars) {
+  ThreadPool &pool = thread_pool();
+  HW04_PERF_BEGIN(PERF_FORCE);
+  kick_tree_mt(stars, G_dt);
+  const std::size_t grain = mt_grain(stars);
+  HW04_PERF_NEXT(PERF_DRIFT);
+  pool.parallel_for((stars.padded + grain - 1) / grain, [&](std::size_t c) {
+    std::size_t b = c * grain, e = std::min(b + grain, stars.padded);
+    mt_kernels.drift(stars, b, e);
+  });
+}
+
+template <Precision P> double step_tree_mt_with_energy(Stars &stars) {
+  double energy = calc_mt<P>(stars);
+  step_tree_mt(stars);
+  return energy;
+}
+
+/*
+✅ 常驻线程 + 屏障同步的时间步循环（run_timesteps）：
+
+ * N=48时一步只要几微秒，每步唤醒线程(parallel_for)的开销比计算本身还大
+ * 整个循环只唤醒线程一次，每个线程固定负责一段星体，每步在两个阶段之间用屏障同步：
+   引力阶段(读全部位置，写自己那段速度) -> 屏障 -> 位置阶段(写自己那段位置) -> 屏障
+ * 屏障是sense-reversing的：计数归零的线程翻转全局sense，其余线程等待sense变化，
+   不需要每轮重置，连续两轮之间也不会互相混淆
+ * 等待策略先自旋最多HW04_SPIN微秒（默认50，超过64次_mm_pause后改为sched_yield），仍未到齐再挂起在
+   条件变量上；HW04_SPIN<0表示一直自旋。按时间而不是按次数限制，_mm_pause的周期数各代CPU差别很大
+ * 线程数超过可用CPU时默认不自旋直接挂起：自旋的线程占着的正是还没到屏障的线程需要的CPU
+*/
+
+/**
+ * @brief 先自旋后挂起的sense-reversing屏障，spin是自旋的微秒数，0表示直接挂起，<0表示一直自旋
+ */
+class SpinBarrier {
+public:
+  SpinBarrier(unsigned threads, long spin) : threads_(threads), count_(threads), spin_(spin) {}
+
+  /**
+   * @brief local_sense是每个线程自己的变量，初始为false
+   */
+  void wait(bool &local_sense) {
+    local_sense = !local_sense;
+    if (count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      count_.store(threads_, std::memory_order_relaxed);
+      sense_.store(local_sense, std::memory_order_seq_cst);
+      if (parked_.load(std::memory_order_seq_cst) > 0) {
+        { std::lock_guard<std::mutex> lock(mutex_); }
+        wake_.notify_all();
+      }
+      return;
+    }
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(spin_);
+    unsigned k = 0;
+    for (long n = 0; spin_ != 0; n++) {
+      if (sense_.load(std::memory_order_acquire) == local_sense)
+        return;
+      if (spin_ > 0 && n % 16 == 15 && std::chrono::steady_clock::now() >= deadline)
+        break;
+      spin_backoff(k);
+    }
+    // 先登记再检查条件，与释放线程"先写sense再读parked"配对，不会丢失唤醒
+    parked_.fetch_add(1, std::memory_order_seq_cst);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [&] { return sense_.load(std::memory_order_seq_cst) == local_sense; });
+    }
+    parked_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+private:
+  const unsigned threads_;
+  alignas(CACHE_LINE) std::atomic<unsigned> count_;
+  alignas(CACHE_LINE) std::atomic<bool> sense_{false};
+  alignas(CACHE_LINE) std::atomic<unsigned> parked_{0};
+  const long spin_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+};
+
+/**
+ * @brief 屏障的自旋微秒数：HW04_SPIN优先，否则线程数超过可用CPU时为0，其余为50
+ */
+long barrier_spin(unsigned threads) {
+  if (const char *env = std::getenv("HW04_SPIN"))
+    return std::strtol(env, nullptr, 10);
+  if (threads > available_cpus())
+    return 0;
+  return 50;
+}
+
+/**
+ * @brief 用常驻线程跑完steps步，每energy_every步输出一次融合计算的能量（0表示不输出）
+ */
+void run_timesteps(Stars &stars, long first, long last, long energy_every,
+                   BetweenSteps *between = nullptr) {
+  ThreadPool &pool = thread_pool();
+  const unsigned threads = pool.size();
+  SpinBarrier barrier(threads, barrier_spin(threads));
+  // 静态划分：每个线程一段连续、64字节对齐的星体
+  const std::size_t per = Arena::round_up((stars.padded + threads - 1) / threads, SIMD_WIDTH);
+  struct alignas(CACHE_LINE) Partial {
+    double energy;
+  };
+  std::vector<Partial> partial(threads);
+  pool.run([&](unsigned t) {
+    const std::size_t b = std::min(stars.padded, t * per);
+    const std::size_t e = std::min(stars.padded, b + per);
+    bool sense = false;
+    for (long i = first; i < last; i++) {
+      // 重排会移动所有星体、快照要读所有星体，只能由0号线程在两个屏障之间单独完成
+      if (between && between->due(i)) {
+        if (t == 0)
+          between->run(stars, i);
+        barrier.wait(sense);
+      }
+      const bool report = energy_every > 0 && i % energy_every == 0;
+      if (report)
+        partial[t].energy = mt_kernels.kinetic(stars, b, e) -
+                            0.5 * G * mt_kernels.kick_energy(stars, G_dt, b, e);
+      else if (b < e)
+        mt_kernels.kick(stars, G_dt, b, e);
+      barrier.wait(sense);
+      if (b < e)
+        mt_kernels.drift(stars, b, e);
+      if (report && t == 0) {
+        double energy = 0.0;
+        for (auto const &p : partial)
+          energy += p.energy;
+        printf("Step %ld energy: %f\n", i, energy);
+      }
+      barrier.wait(sense);
+    }
+  });
+}
+#endif
+
+#ifdef HW04_GPU
+/*
+✅ 可选的GPU后端（main_gpu目标，cmake -DHW04_GPU=CUDA或HIP，实现在gpu.cu）：
+
+ * 星体数组在整个时间步循环中常驻显存，每步只有两次核启动（引力、位置更新），没有主机-设备拷贝
+ * 引力核每个线程一个i，线程块把BLOCK个j读进共享内存后所有线程复用
+ * 只有在需要calc()能量、快照、检查点或重排的那一步之前才把状态拷回主机，重排之后再传上去
+ * 只接管直接求和 + float + 原积分器的组合，其他组合以及没有GPU时仍走CPU核，CPU核是验证的参考
+ * HW04_DEVICE=cpu可以在main_gpu里强制使用CPU
+*/
+namespace gpu {
+struct Device;
+struct Params {
+  float g_dt, dt, eps_sqr;
+};
+Device *open(std::size_t n, std::size_t padded, Params params);
+const char *name(Device const *d);
+void upload(Device *d, const float *host);
+void download(Device *d, float *host);
+void run(Device *d, long steps);
+void close(Device *d);
+} // namespace gpu
+
+/**
+ * @brief GPU上跑完[first, last)步，语义与CPU循环相同；没有可用的GPU时返回false，调用者退回CPU
+ *
+ * 七个数组在Stars里首尾相接（padded是16的倍数，arena的64字节对齐不会留空隙），一次拷贝即可。
+ */
+bool run_gpu(Stars &stars, long first, long last, long energy_every, BetweenSteps &between) {
+  if (const char *env = std::getenv("HW04_DEVICE"))
+    if (std::strcmp(env, "cpu") == 0)
+      return false;
+  std::unique_ptr<gpu::Device, void (*)(gpu::Device *)> dev(
+      gpu::open(stars.n, stars.padded, gpu::Params{G_dt, dt, eps_sqr}), gpu::close);
+  if (!dev)
+    return false;
+  printf("Device: %s\n", gpu::name(dev.get()));
+  gpu::upload(dev.get(), stars.px);
+  auto report = [&](long i) { return energy_every > 0 && i % energy_every == 0; };
+  for (long i = first; i < last;) {
+    if (report(i) || between.due(i)) {
+      gpu::download(dev.get(), stars.px);
+      if (report(i))
+        printf("Step %ld energy: %f\n", i, calc(stars));
+      if (between.due(i)) {
+        between.run(stars, i);
+        if (between.reorder_every > 0 && i % between.reorder_every == 0)
+          gpu::upload(dev.get(), stars.px);
+      }
+    }
+    long next = i + 1;
+    while (next < last && !report(next) && !between.due(next))
+      next++;
+    gpu::run(dev.get(), next - i);
+    i = next;
+  }
+  gpu::download(dev.get(), stars.px);
+  return true;
+}
+#endif
+
+/**
+ * @brief 用计数器RNG生成初始状态；main_mt中按段并行，结果与线程数无关
+ */
+void init(Stars &stars, InitKind kind, std::uint64_t seed) {
+  rng_state = {seed, 0};
+  constexpr std::size_t grain = 64 * SIMD_WIDTH;
+#ifdef HW04_MT
+  thread_pool().parallel_for((stars.n + grain - 1) / grain, [&](std::size_t c) {
+    init_range(stars, kind, seed, c * grain, (c + 1) * grain);
+  });
+#else
+  for (std::size_t b = 0; b < stars.n; b += grain)
+    init_range(stars, kind, seed, b, b + grain);
+#endif
+  init_finish(stars, kind);
+}
+
+/**
+ * @brief 单次计时，返回毫秒；main()的总用时仍然用它，多次统计见bench_suite()
+ */
+template <class Func> long benchmark(Func const &func) {
+  std::int64_t t0 = now_ns();
+  func();
+  std::int64_t t1 = now_ns();
+  return (long)((t1 - t0) / 1000000);
+}
+
+#ifdef HW04_MPI
+/*
+✅ 多节点环形流水线（main_mpi目标，cmake -DHW04_MPI=ON，mpirun -np P build/main_mpi N）：
+
+ * 每个进程拥有一段连续的星体（段长补齐到SIMD_WIDTH），只有它更新这些星体的速度和位置
+ * 引力阶段：j块(px, py, pz, mass)沿环传递P - 1次，每次用MPI_Isend/MPI_Irecv把当前块传给右邻、
+   从左邻收下一块，同时用本地核计算当前块对本段的引力，通信被计算掩盖
+ * 所有进程的块一样长（最长段的长度），补齐部分质量为0，一次消息就是一整块连续内存
+ * 环走完之后各段的部分和乘G * dt加到速度上，再更新位置，所以结果与单进程的求和只有顺序不同
+ * calc()变成环上的势能 + 本地动能，再MPI_Allreduce求和；融合能量的step同理
+ * 初始条件由各进程各自生成完整的一份再取自己的段（init()是确定性的），不需要广播
+ * 只接管直接求和 + 原积分器；快照、检查点和重排不支持多进程
+*/
+struct MpiRing {
+  int rank = 0, size = 1;
+  std::size_t begin = 0, count = 0; // 本进程拥有的全局星体区间[begin, begin + count)
+  std::size_t cap = 0;              // 每个j块的长度（所有进程相同，SIMD_WIDTH的倍数）
+  Arena arena;
+  float *block[2] = {};             // 当前计算的块与正在接收的块，各4 * cap个float
+  float *acc = nullptr;             // 本段引力的部分和，3 * local.padded个float
+};
+
+using SourceFn = double (*)(Stars const &, const float *, const float *, const float *,
+                            const float *, std::size_t, float *, float *, float *);
+
+/**
+ * @brief 源块核只有SIMD版本，标量用SSE代替（与块时间步相同）
+ */
+SourceFn select_source(Isa isa, bool energy) {
+  switch (isa) {
+  case Isa::AVX512:
+    return energy ? avx512::force_source<true> : avx512::force_source<false>;
+  case Isa::AVX2: return energy ? avx2::force_source<true> : avx2::force_source<false>;
+  case Isa::Scalar:
+  case Isa::SSE: break;
+  }
+  return energy ? sse::force_source<true> : sse::force_source<false>;
+}
+
+/**
+ * @brief 走一圈环，把所有进程的j块对本段的引力累加到ring.acc，返回本段的势能和(Energy时)
+ */
+double ring_forces(MpiRing &ring, Stars const &local, SourceFn source) {
+  const std::size_t cap = ring.cap;
+  std::fill(ring.acc, ring.acc + 3 * local.padded, 0.0f);
+  float *cur = ring.block[0], *next = ring.block[1];
+  std::copy(local.px, local.px + local.padded, cur);
+  std::copy(local.py, local.py + local.padded, cur + cap);
+  std::copy(local.pz, local.pz + local.padded, cur + 2 * cap);
+  std::copy(local.mass, local.mass + local.padded, cur + 3 * cap);
+  std::fill(cur + local.padded, cur + cap, 0.0f);
+  std::fill(cur + cap + local.padded, cur + 2 * cap, 0.0f);
+  std::fill(cur + 2 * cap + local.padded, cur + 3 * cap, 0.0f);
+  std::fill(cur + 3 * cap + local.padded, cur + 4 * cap, 0.0f);
+  const int right = (ring.rank + 1) % ring.size, left = (ring.rank + ring.size - 1) % ring.size;
+  double pot = 0.0;
+  for (int k = 0; k < ring.size; k++) {
+    MPI_Request req[2];
+    const bool pass = k + 1 < ring.size;
+    if (pass) {
+      MPI_Irecv(next, (int)(4 * cap), MPI_FLOAT, left, k, MPI_COMM_WORLD, &req[0]);
+      MPI_Isend(cur, (int)(4 * cap), MPI_FLOAT, right, k, MPI_COMM_WORLD, &req[1]);
+    }
+    pot += source(local, cur, cur + cap, cur + 2 * cap, cur + 3 * cap, cap, ring.acc,
+                  ring.acc + local.padded, ring.acc + 2 * local.padded);
+    if (pass) {
+      MPI_Waitall(2, req, MPI_STATUSES_IGNORE);
+      std::swap(cur, next);
+    }
+  }
+  return pot;
+}
+
+/**
+ * @brief 本段动能，按编号顺序用double累加
+ */
+double local_kinetic(Stars const &s) {
+  double e = 0.0;
+  for (std::size_t i = 0; i < s.n; i++)
+    e += 0.5 * s.mass[i] * (s.vx[i] * s.vx[i] + s.vy[i] * s.vy[i] + s.vz[i] * s.vz[i]);
+  return e;
+}
+
+/**
+ * @brief 一步：环上算引力并更新本段的速度；report时返回本步开始时的全局总能量（所有进程相同）
+ */
+double mpi_step(MpiRing &ring, Stars &local, SourceFn source, bool report) {
+  double energy = report ? local_kinetic(local) : 0.0;
+  double pot = ring_forces(ring, local, source);
+  float *ax = ring.acc, *ay = ax + local.padded, *az = ay + local.padded;
+  for (std::size_t i = 0; i < local.n; i++) {
+    local.vx[i] += G_dt * ax[i];
+    local.vy[i] += G_dt * ay[i];
+    local.vz[i] += G_dt * az[i];
+  }
+  drift(local, dt);
+  if (!report)
+    return 0.0;
+  energy -= 0.5 * G * pot;
+  MPI_Allreduce(MPI_IN_PLACE, &energy, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  return energy;
+}
+
+/**
+ * @brief 多进程版的calc()：所有进程都必须调用，返回全局总能量
+ */
+double mpi_calc(MpiRing &ring, Stars const &local, Isa isa) {
+  double energy = local_kinetic(local) - 0.5 * G * ring_forces(ring, local, select_source(isa, true));
+  MPI_Allreduce(MPI_IN_PLACE, &energy, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  return energy;
+}
+
+/**
+ * @brief 多进程模式的整个程序：输出格式与单进程相同，只由0号进程打印
+ */
+int run_mpi(std::size_t n, Isa isa, long steps, long energy_every) {
+  MpiRing ring;
+  MPI_Comm_rank(MPI_COMM_WORLD, &ring.rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &ring.size);
+  const std::size_t per = Arena::round_up((n + ring.size - 1) / ring.size, SIMD_WIDTH);
+  ring.begin = std::min(n, (std::size_t)ring.rank * per);
+  ring.count = std::min(n, ring.begin + per) - ring.begin;
+  ring.cap = per;
+  Stars local(ring.count);
+  ring.arena = Arena((8 * ring.cap + 3 * local.padded) * sizeof(float));
+  ring.block[0] = ring.arena.take(4 * ring.cap);
+  ring.block[1] = ring.arena.take(4 * ring.cap);
+  ring.acc = ring.arena.take(3 * local.padded);
+  {
+    const InitKind kind = detect_init_kind();
+    std::uint64_t seed = 1;
+    if (const char *env = std::getenv("HW04_SEED"))
+      seed = std::strtoull(env, nullptr, 10);
+    Stars all(n);
+    if (kind == InitKind::Rand)
+      init(all);
+    else
+      init(all, kind, seed);
+    float *src[] = {all.px, all.py, all.pz, all.vx, all.vy, all.vz, all.mass};
+    float *dst[] = {local.px, local.py, local.pz, local.vx, local.vy, local.vz, local.mass};
+    for (std::size_t a = 0; a < Stars::NUM_ARRAYS; a++)
+      std::copy(src[a] + ring.begin, src[a] + ring.begin + ring.count, dst[a]);
+  }
+  const bool root = ring.rank == 0;
+  const SourceFn source = select_source(isa, false), source_energy = select_source(isa, true);
+  double e0 = mpi_calc(ring, local, isa);
+  if (root) {
+    printf("Ranks: %d, %zu stars per rank\n", ring.size, per);
+    printf("Kernel: %s (full, float)\n", isa_name(isa));
+    printf("Initial energy: %f\n", e0);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  long ms = benchmark([&] {
+    for (long i = 0; i < steps; i++) {
+      const bool report = energy_every > 0 && i % energy_every == 0;
+      double e = mpi_step(ring, local, report ? source_energy : source, report);
+      if (report && root)
+        printf("Step %ld energy: %f\n", i, e);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+  });
+  double e1 = mpi_calc(ring, local, isa);
+  if (root) {
+    printf("Final energy: %f\n", e1);
+    printf("Time elapsed: %ld ms\n", ms);
+  }
+  return 0;
+}
+#endif
+
+/*
+✅ 微基准测试框架（main --bench）：
+
+ * 单次毫秒计时在我们的机器上波动±15%，48体的一步只有微秒级，无法单独测量
+ * 每个变体先预热，再重复多轮(trial)，每轮连续跑若干步，步数自动标定到每轮约2ms
+ * 每轮同时记录steady_clock纳秒和TSC周期数，报告每步的中位数/p99/最小值
+ * interactions/s按N²/时间计算（对称模式也按N²计，便于和Full直接比较）
+ * GFLOP/s按每次相互作用固定FLOPS_PER_INTERACTION次浮点运算计算，是约定的口径，不是实测
+ * 扫描HW04_BENCH_N（逗号分隔）中的每个N与kernel_variants()中的每个变体，
+   HW04_BENCH_FORMAT=csv|json选择输出格式，HW04_BENCH_TRIALS设置轮数
+*/
+constexpr double FLOPS_PER_INTERACTION = 20.0; // 沿用N体文献中常用的每次相互作用20次的口径
+
+/**
+ * @brief 一个可以被基准测试和回归测试枚举的步进核
+ */
+struct KernelVariant {
+  std::string name;
+  Isa isa;
+  ForceMode mode;
+  Precision prec;
+  StepFn fn;
+  bool threaded;
+};
+
+/**
+ * @brief 当前CPU（以及HW04_ISA上限）支持的全部变体，标量参考总是排在第一个
+ */
+std::vector<KernelVariant> kernel_variants() {
+  std::vector<KernelVariant> out;
+  Isa best = detect_isa();
+  for (Isa isa : {Isa::Scalar, Isa::SSE, Isa::AVX2, Isa::AVX512}) {
+    if (isa > best)
+      continue;
+    for (Precision p : {Precision::Float, Precision::Double, Precision::Compensated})
+      out.push_back({std::string(isa_name(isa)) + "/full/" + precision_name(p), isa,
+                     ForceMode::Full, p, select_step(isa, ForceMode::Full, p), false});
+    out.push_back({std::string(isa_name(isa)) + "/symmetric/float", isa, ForceMode::Symmetric,
+                   Precision::Float, select_step(isa, ForceMode::Symmetric, Precision::Float),
+                   false});
+    // full/float已经按N分派到编译期特化的实例，这里保留运行时N的通用核作对照
+    StepFn generic = isa == Isa::AVX512 ? avx512::step<Precision::Float>
+                     : isa == Isa::AVX2 ? avx2::step<Precision::Float>
+                     : isa == Isa::SSE  ? sse::step<Precision::Float>
+                                        : step<Precision::Float>;
+    if (isa != Isa::Scalar)
+      out.push_back({std::string(isa_name(isa)) + "/generic/float", isa, ForceMode::Full,
+                     Precision::Float, generic, false});
+    if (isa != Isa::Scalar)
+      out.push_back({std::string(isa_name(isa)) + "/compressed/float", isa, ForceMode::Compressed,
+                     Precision::Float, select_step(isa, ForceMode::Compressed, Precision::Float),
+                     false});
+  }
+  // 截断模式只有SIMD核；邻居表的r_c由调用者设置（--validate用VALIDATE_CUTOFF）
+  for (Isa isa : {Isa::SSE, Isa::AVX2, Isa::AVX512})
+    if (isa <= best)
+      out.push_back({std::string(isa_name(isa)) + "/cutoff/float", isa, ForceMode::Cutoff,
+                     Precision::Float, select_step(isa, ForceMode::Cutoff, Precision::Float), false});
+  // Barnes-Hut与ISA无关，只注册一次
+  out.push_back({"scalar/tree/float", Isa::Scalar, ForceMode::Tree, Precision::Float, step_tree,
+                 false});
+  out.push_back({"scalar/fmm/float", Isa::Scalar, ForceMode::Fmm, Precision::Float, step_fmm,
+                 false});
+#ifdef HW04_MT
+  for (Precision p : {Precision::Float, Precision::Double})
+    out.push_back({std::string(isa_name(best)) + "/mt/" + precision_name(p), best,
+                   ForceMode::Full, p, step_mt, true});
+#endif
+  return out;
+}
+
+struct BenchResult {
+  std::string variant;
+  std::size_t n;
+  long steps_per_trial;
+  int trials;
+  double median_ns, p99_ns, min_ns; // 每步
+  double tsc_per_step;              // 每步TSC周期数（中位数那一轮）
+  double interactions_per_s, gflops;
+#ifdef HW04_PERF
+  PerfTotals perf; // 计时轮次中每个阶段的计数差
+#endif
+};
+
+/**
+ * @brief 对一个变体做预热、标定和多轮计时
+ */
+BenchResult bench_variant(KernelVariant const &v, std::size_t n, int trials) {
+#ifdef HW04_MT
+  if (v.threaded)
+    mt_kernels = select_range_kernels(v.isa, v.prec);
+#endif
+  Stars stars(n);
+  rng_seed(1);
+  init(stars);
+  for (int w = 0; w < 3; w++)
+    v.fn(stars);
+  // 标定：让每轮大约2ms，至少1步
+  std::int64_t t0 = now_ns();
+  v.fn(stars);
+  std::int64_t one = std::max<std::int64_t>(now_ns() - t0, 1);
+  long steps = (long)std::max<std::int64_t>(1, 2000000 / one);
+
+  std::vector<double> ns(trials), tsc(trials);
+#ifdef HW04_PERF
+  const PerfTotals perf0 = perf_counters().totals;
+#endif
+  for (int t = 0; t < trials; t++) {
+    std::uint64_t c0 = __rdtsc();
+    std::int64_t s0 = now_ns();
+    for (long k = 0; k < steps; k++)
+      v.fn(stars);
+    std::int64_t s1 = now_ns();
+    std::uint64_t c1 = __rdtsc();
+    ns[t] = (double)(s1 - s0) / (double)steps;
+    tsc[t] = (double)(c1 - c0) / (double)steps;
+  }
+#ifdef HW04_PERF
+  PerfTotals perf1 = perf_counters().totals;
+#endif
+  std::vector<double> sorted = ns;
+  std::sort(sorted.begin(), sorted.end());
+  auto rank = [&](double q) {
+    std::size_t r = (std::size_t)std::ceil(q * (double)trials);
+    return sorted[std::min<std::size_t>(r ? r - 1 : 0, trials - 1)];
+  };
+  BenchResult r;
+  r.variant = v.name;
+  r.n = n;
+  r.steps_per_trial = steps;
+  r.trials = trials;
+  r.median_ns = rank(0.5);
+  r.p99_ns = rank(0.99);
+  r.min_ns = sorted.front();
+  r.tsc_per_step = tsc[std::find(ns.begin(), ns.end(), r.median_ns) - ns.begin()];
+  double pairs = (double)n * (double)n;
+  r.interactions_per_s = pairs / (r.median_ns * 1e-9);
+  r.gflops = r.interactions_per_s * FLOPS_PER_INTERACTION * 1e-9;
+#ifdef HW04_PERF
+  for (int p = 0; p < PERF_NUM_PHASES; p++) {
+    r.perf.calls[p] = perf1.calls[p] - perf0.calls[p];
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+      r.perf.value[p][c] = perf1.value[p][c] - perf0.value[p][c];
+  }
+#endif
+  return r;
+}
+
+/**
+ * @brief 解析逗号分隔的正整数列表，env为空时用fallback
+ */
+std::vector<std::size_t> parse_sizes(const char *env, const char *fallback) {
+  std::vector<std::size_t> sizes;
+  std::string list = env ? env : fallback;
+  for (std::size_t pos = 0; pos < list.size();) {
+    std::size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    if (std::size_t v = std::strtoul(list.substr(pos, end - pos).c_str(), nullptr, 10))
+      sizes.push_back(v);
+    pos = end + 1;
+  }
+  return sizes;
+}
+
+std::vector<std::size_t> bench_sizes() {
+  return parse_sizes(std::getenv("HW04_BENCH_N"), "48,256,1024,4096");
+}
+
+#ifdef HW04_PERF
+/**
+ * @brief 每步的平均计数：引力阶段与位置更新阶段各一组
+ */
+double perf_per_call(BenchResult const &r, int p, int c) {
+  return r.perf.calls[p] ? (double)r.perf.value[p][c] / (double)r.perf.calls[p] : 0.0;
+}
+#endif
+
+void print_bench(std::vector<BenchResult> const &results, bool json) {
+  if (json) {
+    printf("[\n");
+    for (std::size_t k = 0; k < results.size(); k++) {
+      BenchResult const &r = results[k];
+      printf("  {\"variant\": \"%s\", \"n\": %zu, \"steps_per_trial\": %ld, \"trials\": %d, "
+             "\"median_ns\": %.1f, \"p99_ns\": %.1f, \"min_ns\": %.1f, \"tsc_per_step\": %.1f, "
+             "\"interactions_per_s\": %.6g, \"gflops\": %.3f",
+             r.variant.c_str(), r.n, r.steps_per_trial, r.trials, r.median_ns, r.p99_ns,
+             r.min_ns, r.tsc_per_step, r.interactions_per_s, r.gflops);
+#ifdef HW04_PERF
+      for (int p : {PERF_FORCE, PERF_DRIFT})
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+          printf(", \"%s_%s\": %.1f", perf_phase_name(p), perf_counter_name(c),
+                 perf_per_call(r, p, c));
+#endif
+      printf("}%s\n", k + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+    return;
+  }
+  printf("variant,n,steps_per_trial,trials,median_ns,p99_ns,min_ns,tsc_per_step,"
+         "interactions_per_s,gflops");
+#ifdef HW04_PERF
+  for (int p : {PERF_FORCE, PERF_DRIFT})
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+      printf(",%s_%s", perf_phase_name(p), perf_counter_name(c));
+#endif
+  printf("\n");
+  for (BenchResult const &r : results) {
+    printf("%s,%zu,%ld,%d,%.1f,%.1f,%.1f,%.1f,%.6g,%.3f", r.variant.c_str(), r.n,
+           r.steps_per_trial, r.trials, r.median_ns, r.p99_ns, r.min_ns, r.tsc_per_step,
+           r.interactions_per_s, r.gflops);
+#ifdef HW04_PERF
+    for (int p : {PERF_FORCE, PERF_DRIFT})
+      for (int c = 0; c < PERF_NUM_COUNTERS; c++)
+        printf(",%.1f", perf_per_call(r, p, c));
+#endif
+    printf("\n");
+  }
+}
+
+/**
+ * @brief 扫描所有N和所有变体，结果输出到stdout
+ */
+int bench_suite() {
+  int trials = 21;
+  if (const char *env = std::getenv("HW04_BENCH_TRIALS"))
+    trials = std::max(1, (int)std::strtol(env, nullptr, 10));
+  const char *fmt = std::getenv("HW04_BENCH_FORMAT");
+  bool json = fmt && std::strcmp(fmt, "json") == 0;
+  std::vector<BenchResult> results;
+  for (std::size_t n : bench_sizes())
+    for (KernelVariant const &v : kernel_variants())
+      results.push_back(bench_variant(v, n, trials));
+  print_bench(results, json);
+  return 0;
+}
+
+/*
+✅ 能量漂移回归测试（main --validate，或cmake --build . --target validate）：
+
+ * 每个更快的核都会改变数值：rsqrt近似、混合精度、树方法、压缩布局……这里把kernel_variants()中的
+   每个变体都与全double的参考实现比较，任何一项超过容差时返回1，可以直接作为合并前的门禁
+ * 参考实现先把状态转换为double，引力、能量、积分的每一步都用double；能量与calc()一样含自能项
+ * 对HW04_VALIDATE_N（默认48,256,1024）中的每个N、HW04_VALIDATE_SEEDS（默认1,2,3）中的每个种子：
+   1. 加速度：速度清零后让变体走一步，新的速度除以dt就是它算出的加速度（避免v + Δv的相消误差），
+      逐星体与参考比较相对误差，报告rms和max
+   2. 能量：变体精度下的calc()与参考能量的相对误差
+   3. 漂移：变体与参考各自推进K步（HW04_VALIDATE_STEPS，默认2000，大N按N²缩减到约5e7次相互作用），
+      都用参考能量计算相对初始能量的漂移，比较两者之差；轨道会因混沌分开，能量漂移却应当接近
+ * 容差按变体的数值类别给出（validation_bounds），HW04_VALIDATE_SLACK把所有容差乘一个系数
+ * 截断模式（r_c = VALIDATE_CUTOFF）的参考是同一个double实现换成shifted-force的力和势能，
+   漂移检查因此也验证了cutoff_energy的势能确实与force_neighbors的力配对
+*/
+constexpr float VALIDATE_CUTOFF = 0.5f;
+
+/**
+ * @brief 一个变体允许的最大误差
+ */
+struct ValidationBounds {
+  double acc_rms, acc_max; // 逐星体加速度的相对误差
+  double energy;           // calc()的相对误差
+  double drift;            // 与参考之间相对初始能量的漂移之差
+};
+
+/**
+ * @brief 各类别的容差，约为默认N/种子下实测最大误差的3~10倍
+ */
+ValidationBounds validation_bounds(KernelVariant const &v) {
+  switch (v.mode) {
+  case ForceMode::Tree: return {3e-2, 5e-1, 1e-5, 1e-2};
+  case ForceMode::Fmm: return {1e-2, 5e-2, 1e-5, 1e-4};
+  case ForceMode::Compressed: return {2e-3, 2e-2, 1e-5, 5e-3};
+  case ForceMode::Cutoff: return {2e-6, 2e-5, 1e-6, 2e-5};
+  default: break;
+  }
+  // 直接求和：float核受rsqrt + 一次牛顿迭代的精度限制；double/补偿求和只剩float输入与输出的舍入，
+  // calc()的每一项仍是float运算，只有累加是更高精度
+  if (v.prec == Precision::Float)
+    return {2e-6, 2e-5, 1e-5, 1e-5};
+  return {1e-6, 2e-5, 1e-6, 1e-5};
+}
+
+/**
+ * @brief 全double的参考状态，从Stars的float数据转换而来
+ */
+struct ReferenceState {
+  std::vector<double> px, py, pz, vx, vy, vz, mass;
+
+  explicit ReferenceState(Stars const &s)
+      : px(s.px, s.px + s.n), py(s.py, s.py + s.n), pz(s.pz, s.pz + s.n), vx(s.vx, s.vx + s.n),
+        vy(s.vy, s.vy + s.n), vz(s.vz, s.vz + s.n), mass(s.mass, s.mass + s.n) {}
+
+  std::size_t size() const { return px.size(); }
+};
+
+/**
+ * @brief 参考的两两相互作用：rc = 0时是完整的软化引力，否则是截断模式的shifted-force形式
+ */
+struct ReferencePair {
+  double e2, rc2, shift, slope;
+
+  explicit ReferencePair(double rc) : e2((double)eps * (double)eps), rc2(rc * rc), shift(0), slope(0) {
+    if (rc > 0.0) {
+      const double sc = std::sqrt(rc2 + e2);
+      shift = 1.0 / sc, slope = 0.5 / (sc * sc * sc);
+    }
+  }
+
+  bool inside(double r2) const { return rc2 == 0.0 || r2 < rc2; }
+
+  // 力的系数：a_i += m_j * d * force(r²)，与force_neighbors相同，2 * slope = s(r_c)⁻³
+  double force(double r2) const {
+    const double s = std::sqrt(r2 + e2);
+    return inside(r2) ? 1.0 / (s * s * s) - 2.0 * slope : 0.0;
+  }
+
+  // 势能：U_ij = -G m_i m_j * potential(r²)，-∇U就是上面的力
+  double potential(double r2) const {
+    return inside(r2) ? 1.0 / std::sqrt(r2 + e2) - shift - (rc2 - r2) * slope : 0.0;
+  }
+};
+
+/**
+ * @brief 参考加速度（含G），rc = 0时与step()的引力公式相同
+ */
+void reference_accelerations(ReferenceState const &r, double rc, double *ax, double *ay,
+                             double *az) {
+  const ReferencePair pair(rc);
+  for (std::size_t i = 0; i < r.size(); i++) {
+    double x = 0.0, y = 0.0, z = 0.0;
+    for (std::size_t j = 0; j < r.size(); j++) {
+      double dx = r.px[j] - r.px[i], dy = r.py[j] - r.py[i], dz = r.pz[j] - r.pz[i];
+      double f = r.mass[j] * pair.force(dx * dx + dy * dy + dz * dz);
+      x += dx * f, y += dy * f, z += dz * f;
+    }
+    ax[i] = (double)G * x, ay[i] = (double)G * y, az[i] = (double)G * z;
+  }
+}
+
+/**
+ * @brief 参考能量，与calc()（rc > 0时与cutoff_energy()）一样对所有(i, j)求和，包含自能项
+ */
+double reference_energy(ReferenceState const &r, double rc) {
+  const ReferencePair pair(rc);
+  double energy = 0.0;
+  for (std::size_t i = 0; i < r.size(); i++) {
+    energy += 0.5 * r.mass[i] * (r.vx[i] * r.vx[i] + r.vy[i] * r.vy[i] + r.vz[i] * r.vz[i]);
+    for (std::size_t j = 0; j < r.size(); j++) {
+      double dx = r.px[j] - r.px[i], dy = r.py[j] - r.py[i], dz = r.pz[j] - r.pz[i];
+      energy -= 0.5 * (double)G * r.mass[i] * r.mass[j] * pair.potential(dx * dx + dy * dy + dz * dz);
+    }
+  }
+  return energy;
+}
+
+/**
+ * @brief 与step()相同的半隐式欧拉：先用全部旧位置更新速度，再更新位置
+ */
+void reference_step(ReferenceState &r, double rc, double *ax, double *ay, double *az) {
+  reference_accelerations(r, rc, ax, ay, az);
+  for (std::size_t i = 0; i < r.size(); i++) {
+    r.vx[i] += ax[i] * (double)dt, r.vy[i] += ay[i] * (double)dt, r.vz[i] += az[i] * (double)dt;
+    r.px[i] += r.vx[i] * (double)dt, r.py[i] += r.vy[i] * (double)dt, r.pz[i] += r.vz[i] * (double)dt;
+  }
+}
+
+struct ValidationResult {
+  std::string variant;
+  std::size_t n;
+  unsigned seed;
+  long steps;
+  double acc_rms, acc_max, energy, drift;
+  bool pass;
+};
+
+/**
+ * @brief 同一个(N, 种子)的参考数据，所有变体共用
+ */
+struct ValidationCase {
+  std::size_t n;
+  unsigned seed;
+  double rc;                      // 0表示完整引力，否则是截断模式的r_c
+  long steps;
+  std::vector<double> ax, ay, az; // 初始状态的参考加速度
+  double energy0, drift;          // 参考能量与K步后参考的相对漂移
+};
+
+Stars validation_stars(std::size_t n, unsigned seed) {
+  Stars stars(n);
+  rng_seed(seed);
+  init(stars);
+  return stars;
+}
+
+ValidationCase validation_case(std::size_t n, unsigned seed, double rc, long max_steps) {
+  ValidationCase c{n, seed, rc, 0, std::vector<double>(n), std::vector<double>(n),
+                   std::vector<double>(n), 0.0, 0.0};
+  c.steps = std::min(max_steps, std::max(10L, (long)(5e7 / ((double)n * (double)n))));
+  ReferenceState ref(validation_stars(n, seed));
+  reference_accelerations(ref, rc, c.ax.data(), c.ay.data(), c.az.data());
+  c.energy0 = reference_energy(ref, rc);
+  std::vector<double> ax(n), ay(n), az(n);
+  for (long k = 0; k < c.steps; k++)
+    reference_step(ref, rc, ax.data(), ay.data(), az.data());
+  c.drift = (reference_energy(ref, rc) - c.energy0) / std::fabs(c.energy0);
+  return c;
+}
+
+ValidationResult validate_variant(KernelVariant const &v, ValidationCase const &c, double slack) {
+#ifdef HW04_MT
+  if (v.threaded)
+    mt_kernels = select_range_kernels(v.isa, v.prec);
+#endif
+  ValidationResult r{v.name, c.n, c.seed, c.steps, 0.0, 0.0, 0.0, 0.0, false};
+  // 每次换一组星体，邻居表都要重建
+  NeighborList &nl = neighbor_list();
+  nl.cutoff = (float)c.rc, nl.skin = 0.3f * (float)c.rc, nl.valid = false;
+  // 1. 速度清零走一步，新的速度就是dt·a（a含G）
+  Stars stars = validation_stars(c.n, c.seed);
+  std::fill(stars.vx, stars.vx + stars.padded, 0.0f);
+  std::fill(stars.vy, stars.vy + stars.padded, 0.0f);
+  std::fill(stars.vz, stars.vz + stars.padded, 0.0f);
+  v.fn(stars);
+  double sum = 0.0;
+  for (std::size_t i = 0; i < c.n; i++) {
+    double ex = stars.vx[i] / (double)dt - c.ax[i], ey = stars.vy[i] / (double)dt - c.ay[i],
+           ez = stars.vz[i] / (double)dt - c.az[i];
+    double err2 = ex * ex + ey * ey + ez * ez;
+    double ref2 = c.ax[i] * c.ax[i] + c.ay[i] * c.ay[i] + c.az[i] * c.az[i];
+    // 截断模式下r_c内没有邻居的星体参考加速度恰好为0，此时变体也必须是0
+    double rel = ref2 > 0.0 ? std::sqrt(err2 / ref2) : err2 > 0.0 ? 1.0 : 0.0;
+    sum += rel * rel;
+    r.acc_max = std::max(r.acc_max, rel);
+  }
+  r.acc_rms = std::sqrt(sum / (double)c.n);
+  // 2. 该精度的calc()
+  stars = validation_stars(c.n, c.seed);
+  nl.valid = false;
+  EnergyFn energy_fn = v.mode == ForceMode::Cutoff ? cutoff_energy : select_calc(v.prec);
+  r.energy = std::fabs(energy_fn(stars) - c.energy0) / std::fabs(c.energy0);
+  // 3. K步之后的能量漂移，用参考能量计算
+  for (long k = 0; k < c.steps; k++)
+    v.fn(stars);
+  double drift = (reference_energy(ReferenceState(stars), c.rc) - c.energy0) / std::fabs(c.energy0);
+  r.drift = std::fabs(drift - c.drift);
+  ValidationBounds b = validation_bounds(v);
+  r.pass = r.acc_rms <= slack * b.acc_rms && r.acc_max <= slack * b.acc_max &&
+           r.energy <= slack * b.energy && r.drift <= slack * b.drift;
+  return r;
+}
+
+/**
+ * @brief 全部N、种子和变体的回归测试，有任何一项失败时返回1
+ */
+int validate_suite() {
+  long max_steps = 2000;
+  if (const char *env = std::getenv("HW04_VALIDATE_STEPS"))
+    max_steps = std::max(1L, std::strtol(env, nullptr, 10));
+  double slack = 1.0;
+  if (const char *env = std::getenv("HW04_VALIDATE_SLACK"))
+    slack = std::strtod(env, nullptr);
+  printf("variant,n,seed,steps,acc_rms,acc_max,energy_err,drift_err,status\n");
+  int total = 0, failed = 0;
+  for (std::size_t n : parse_sizes(std::getenv("HW04_VALIDATE_N"), "48,256,1024"))
+    for (std::size_t seed : parse_sizes(std::getenv("HW04_VALIDATE_SEEDS"), "1,2,3")) {
+      ValidationCase full = validation_case(n, (unsigned)seed, 0.0, max_steps);
+      ValidationCase cut = validation_case(n, (unsigned)seed, VALIDATE_CUTOFF, max_steps);
+      for (KernelVariant const &v : kernel_variants()) {
+        ValidationResult r = validate_variant(v, v.mode == ForceMode::Cutoff ? cut : full, slack);
+        printf("%s,%zu,%u,%ld,%.3g,%.3g,%.3g,%.3g,%s\n", r.variant.c_str(), r.n, r.seed, r.steps,
+               r.acc_rms, r.acc_max, r.energy, r.drift, r.pass ? "pass" : "FAIL");
+        fflush(stdout);
+        total++;
+        failed += !r.pass;
+      }
+    }
+  printf("Validation: %d of %d passed\n", total - failed, total);
+  return failed ? 1 : 0;
+}
+
+/*
+✅ 批量系综模式（HW04_ENSEMBLE=M）：
+
+ * 参数扫描通常是成千上万个互相独立的48体小系统，单个系统填不满宽向量，也填不满多核
+ * 交错SOA布局让每个SIMD lane负责一个系统，一条指令同时推进W个系统，没有水平求和和尾部
+ * 每组W个系统的数据常驻L1，整组跑完全部时间步再换下一组
+ * main_mt中各组之间完全独立，直接交给线程池的parallel_for
+*/
+struct EnsembleKernels {
+  void (*run)(Ensemble &, std::size_t, std::size_t, long);
+  void (*energy)(Ensemble const &, float *);
+};
+
+EnsembleKernels select_ensemble_kernels(Isa isa) {
+  switch (isa) {
+  case Isa::AVX512: return {avx512::ensemble_run, avx512::ensemble_energy};
+  case Isa::AVX2: return {avx2::ensemble_run, avx2::ensemble_energy};
+  case Isa::Scalar: // 系综模式没有标量版本
+  case Isa::SSE: break;
+  }
+  return {sse::ensemble_run, sse::ensemble_energy};
+}
+
+/**
+ * @brief 系综推进steps步，返回用时(ms)，并输出能量漂移的统计
+ */
+long run_ensemble(Ensemble &ens, long steps, Isa isa) {
+  EnsembleKernels k = select_ensemble_kernels(isa);
+  Arena buf(2 * ens.lanes * sizeof(float));
+  float *e0 = buf.take(ens.lanes), *e1 = buf.take(ens.lanes);
+  k.energy(ens, e0);
+  long ms = benchmark([&] {
+    const std::size_t blocks = ens.lanes / SIMD_WIDTH;
+#ifdef HW04_MT
+    thread_pool().parallel_for(blocks, [&](std::size_t b) {
+      k.run(ens, b * SIMD_WIDTH, (b + 1) * SIMD_WIDTH, steps);
+    });
+#else
+    k.run(ens, 0, blocks * SIMD_WIDTH, steps);
+#endif
+  });
+  k.energy(ens, e1);
+  double mean = 0.0, max_drift = 0.0;
+  for (std::size_t s = 0; s < ens.systems; s++) {
+    mean += e0[s];
+    max_drift = std::max(max_drift, (double)std::fabs((e1[s] - e0[s]) / e0[s]));
+  }
+  printf("Ensemble: %zu systems x %zu stars\n", ens.systems, ens.bodies);
+  printf("Mean initial energy: %f\n", mean / (double)ens.systems);
+  printf("System 0 energy: %f -> %f\n", e0[0], e1[0]);
+  printf("Max relative energy drift: %g\n", max_drift);
+  return ms;
+}
+
+/*
+✅ 软实时流式模式（HW04_REALTIME=每步预算，微秒）：
+
+ * 交互式可视化要求每一帧在固定预算内推进一步，固定步数的循环换成Realtime::run，逐步计时
+ * 每步的延迟（含步间事务和发布位置）记入对数分桶直方图：每个2的幂分8个线性子桶，
+   相对误差不超过1/8；记录只是一次数组加法，不分配内存，结束时输出分位数和超预算步数
+ * 开始前预取并锁定内存：先写一遍栈上的一块区域，再mlockall(MCL_CURRENT | MCL_FUTURE)，
+   已有的页全部驻留，之后的分配也不会被换出；没有权限（RLIMIT_MEMLOCK）时只警告，继续运行
+ * 每步之后把位置发布到无锁的单生产者环形缓冲区PositionRing，槽满时丢帧计数，模拟线程从不等待读者
+ * HW04_REALTIME_PACE=1时按预算定速，每步对齐到绝对时刻start + k·budget，超时不累积误差；
+   否则尽快跑，只统计延迟
+ * 渲染器由一个替身读者线程代替：每HW04_REALTIME_POLL微秒（默认1000）取走所有新帧，
+   统计帧从发布到被读到的延迟
+*/
+
+/**
+ * @brief 对数分桶的延迟直方图，纳秒
+ *
+ * 小于8ns的值各占一个桶；之后每个[2^e, 2^(e+1))分成8个等宽子桶，桶号(e-2)·8 + 子桶。
+ */
+class LatencyHistogram {
+public:
+  static constexpr int SUB = 8;
+  static constexpr int BUCKETS = 62 * SUB;
+
+  void record(std::int64_t ns) {
+    std::uint64_t v = (std::uint64_t)std::max<std::int64_t>(ns, 0);
+    count_[bucket(v)]++;
+    total_++;
+    sum_ += v;
+    max_ = std::max(max_, v);
+  }
+
+  std::uint64_t total() const { return total_; }
+  double mean_ns() const { return total_ ? (double)sum_ / (double)total_ : 0.0; }
+  std::uint64_t max_ns() const { return max_; }
+
+  /**
+   * @brief 分位数q对应的桶的上界，即不低于真实分位数的估计
+   */
+  std::uint64_t quantile_ns(double q) const {
+    const std::uint64_t rank = (std::uint64_t)std::ceil(q * (double)total_);
+    std::uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++)
+      if ((seen += count_[b]) >= std::max<std::uint64_t>(rank, 1))
+        return std::min(max_, lower(b + 1));
+    return max_;
+  }
+
+  /**
+   * @brief 按2的幂合并子桶输出非空的行
+   */
+  void print(FILE *out) const {
+    for (int b = 0; b < BUCKETS; b += SUB) {
+      std::uint64_t c = 0;
+      for (int k = 0; k < SUB; k++)
+        c += count_[b + k];
+      if (c)
+        std::fprintf(out, "  [%10.3f, %10.3f) us %10llu\n", (double)lower(b) * 1e-3,
+                     (double)lower(b + SUB) * 1e-3, (unsigned long long)c);
+    }
+  }
+
+private:
+  static int bucket(std::uint64_t v) {
+    if (v < SUB)
+      return (int)v;
+    const int e = 63 - __builtin_clzll(v);
+    return (e - 2) * SUB + (int)((v >> (e - 3)) - SUB);
+  }
+
+  static std::uint64_t lower(int b) {
+    if (b < SUB)
+      return (std::uint64_t)b;
+    return (std::uint64_t)(SUB + b % SUB) << (b / SUB - 1);
+  }
+
+  std::uint64_t count_[BUCKETS] = {};
+  std::uint64_t total_ = 0, sum_ = 0, max_ = 0;
+};
+
+/**
+ * @brief 读者看到的一帧：步号、发布时刻和按原始编号排列的位置
+ */
+struct RingFrame {
+  long step;
+  std::int64_t published_ns;
+  std::size_t n;
+  float const *x, *y, *z;
+};
+
+/**
+ * @brief 单生产者单消费者的无锁环形缓冲区，每个槽放一帧位置
+ *
+ * head_只由模拟线程写，tail_只由读者写，各占一个缓存行避免伪共享。
+ * 生产者写完槽之后release发布head_，读者acquire读head_之后才读槽；
+ * 读者处理完一帧才release推进tail_，生产者acquire看到之后才复用这个槽。
+ */
+class PositionRing {
+public:
+  PositionRing(std::size_t n, std::size_t depth)
+      : n_(n), stride_(Arena::round_up(n, SIMD_WIDTH)), capacity_(round_pow2(depth)),
+        arena_(capacity_ * 3 * stride_ * sizeof(float)), slots_(capacity_) {
+    for (Slot &s : slots_)
+      s.pos = arena_.take(3 * stride_);
+  }
+
+  PositionRing(PositionRing const &) = delete;
+  PositionRing &operator=(PositionRing const &) = delete;
+
+  std::size_t capacity() const { return capacity_; }
+  long published() const { return (long)head_.load(std::memory_order_relaxed); }
+  long dropped() const { return dropped_; }
+
+  /**
+   * @brief 模拟线程调用；槽满返回false并计数，从不阻塞。order非空时按原始编号写出
+   */
+  bool publish(Stars const &s, long step, BodyOrder const *order) {
+    const std::uint64_t h = head_.load(std::memory_order_relaxed);
+    if (h - tail_.load(std::memory_order_acquire) == capacity_) {
+      dropped_++;
+      return false;
+    }
+    Slot &slot = slots_[h & (capacity_ - 1)];
+    float const *src[3] = {s.px, s.py, s.pz};
+    for (int a = 0; a < 3; a++) {
+      float *dst = slot.pos + a * stride_;
+      if (order)
+        for (std::size_t k = 0; k < n_; k++)
+          dst[order->id[k]] = src[a][k];
+      else
+        std::memcpy(dst, src[a], n_ * sizeof(float));
+    }
+    slot.step = step;
+    slot.published_ns = now_ns();
+    head_.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief 读者调用；有新帧时交给f处理并返回true，f返回之前这一帧不会被覆盖
+   */
+  template <class Func> bool consume(Func const &f) {
+    const std::uint64_t t = tail_.load(std::memory_order_relaxed);
+    if (t == head_.load(std::memory_order_acquire))
+      return false;
+    Slot const &slot = slots_[t & (capacity_ - 1)];
+    f(RingFrame{slot.step, slot.published_ns, n_, slot.pos, slot.pos + stride_,
+                slot.pos + 2 * stride_});
+    tail_.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  struct Slot {
+    float *pos = nullptr;
+    long step = 0;
+    std::int64_t published_ns = 0;
+  };
+
+  static std::size_t round_pow2(std::size_t x) {
+    std::size_t p = 1;
+    while (p < x)
+      p <<= 1;
+    return p;
+  }
+
+  std::size_t n_, stride_, capacity_;
+  Arena arena_;
+  std::vector<Slot> slots_;
+  alignas(CACHE_LINE) std::atomic<std::uint64_t> head_{0};
+  alignas(CACHE_LINE) std::atomic<std::uint64_t> tail_{0};
+  alignas(CACHE_LINE) long dropped_ = 0;
+};
+
+/**
+ * @brief 先写一遍栈上的一块区域，再锁定进程的全部内存；失败时返回false并给出原因
+ */
+bool lock_memory() {
+  constexpr std::size_t STACK_PREFAULT = 256 * 1024;
+  // 通过volatile指针写：写入不会被优化掉，数组本身也不算"只写不读"（-Wunused-but-set-variable）
+  unsigned char stack[STACK_PREFAULT];
+  volatile unsigned char *page = stack;
+  for (std::size_t k = 0; k < STACK_PREFAULT; k += 4096)
+    page[k] = 0;
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    std::fprintf(stderr, "realtime: mlockall failed: %s\n", std::strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+class Realtime {
+public:
+  Realtime(std::size_t n, double budget_us, bool pace, std::size_t depth, long poll_us)
+      : budget_ns_((std::int64_t)(budget_us * 1e3)), pace_(pace), poll_us_(std::max(poll_us, 1L)),
+        ring_(n, std::max<std::size_t>(depth, 1)) {}
+
+  /**
+   * @brief 推进[first, last)步，每步调用advance(i)；期间替身读者线程从环形缓冲区取帧
+   */
+  template <class Func>
+  void run(Stars &stars, long first, long last, BetweenSteps &between, BodyOrder const *order,
+           Func const &advance) {
+    locked_ = lock_memory();
+    std::atomic<bool> stop{false};
+    std::thread reader([&] {
+      for (;;) {
+        const bool done = stop.load(std::memory_order_acquire);
+        while (ring_.consume([&](RingFrame const &f) { read(f); }))
+          ;
+        if (done)
+          return;
+        std::this_thread::sleep_for(std::chrono::microseconds(poll_us_));
+      }
+    });
+    const std::int64_t start = now_ns();
+    for (long i = first; i < last; i++) {
+      if (pace_) {
+        const std::int64_t deadline = start + (i - first) * budget_ns_;
+        const std::int64_t wait = deadline - now_ns();
+        if (wait > 0)
+          std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+      }
+      const std::int64_t t0 = now_ns();
+      if (between.due(i))
+        between.run(stars, i);
+      advance(i);
+      ring_.publish(stars, i + 1, order);
+      const std::int64_t ns = now_ns() - t0;
+      steps_.record(ns);
+      overruns_ += ns > budget_ns_;
+    }
+    stop.store(true, std::memory_order_release);
+    reader.join();
+    if (locked_)
+      munlockall();
+  }
+
+  void report(FILE *out) const {
+    std::fprintf(out, "Realtime: budget %.3f us%s, memory %s, %llu steps, %ld over budget\n",
+                 (double)budget_ns_ * 1e-3, pace_ ? " (paced)" : "", locked_ ? "locked" : "unlocked",
+                 (unsigned long long)steps_.total(), overruns_);
+    std::fprintf(out, "Step latency: mean %.3f us, p50 %.3f us, p99 %.3f us, p99.9 %.3f us, max %.3f us\n",
+                 steps_.mean_ns() * 1e-3, (double)steps_.quantile_ns(0.5) * 1e-3,
+                 (double)steps_.quantile_ns(0.99) * 1e-3, (double)steps_.quantile_ns(0.999) * 1e-3,
+                 (double)steps_.max_ns() * 1e-3);
+    steps_.print(out);
+    std::fprintf(out,
+                 "Ring: %zu slots, %ld published, %ld dropped, %ld read, age p99 %.3f us max %.3f us, "
+                 "last radius %g\n",
+                 ring_.capacity(), ring_.published(), ring_.dropped(), (long)ages_.total(),
+                 (double)ages_.quantile_ns(0.99) * 1e-3, (double)ages_.max_ns() * 1e-3,
+                 std::sqrt(extent_));
+  }
+
+private:
+  /**
+   * @brief 替身渲染器：记录帧的延迟，并像真正的渲染那样读一遍所有位置
+   */
+  void read(RingFrame const &f) {
+    ages_.record(now_ns() - f.published_ns);
+    float r2 = 0.0f;
+    for (std::size_t k = 0; k < f.n; k++)
+      r2 = std::max(r2, f.x[k] * f.x[k] + f.y[k] * f.y[k] + f.z[k] * f.z[k]);
+    extent_ = r2;
+  }
+
+  std::int64_t budget_ns_;
+  bool pace_;
+  long poll_us_;
+  bool locked_ = false;
+  long overruns_ = 0;
+  LatencyHistogram steps_; // 只由模拟线程写
+  LatencyHistogram ages_;  // 只由读者线程写，join之后才读
+  float extent_ = 0.0f;
+  PositionRing ring_;
+};
+
+/*
+✅ 命令行与配置文件（main [N] [--config=文件] [--key=value ...] [--bench | --validate]）：
+
+ * 运行参数原来都通过HW04_*环境变量读取，命令行和配置文件是同一套参数的另一种写法：
+   --key=value等价于HW04_KEY=value，key中的'-'换成'_'，例如--force=tree、--reorder=100、
+   --snapshot-every=500；只写--key时值为1
+ * 配置文件每行一个key = value，'#'之后是注释；优先级：命令行 > 配置文件 > 环境变量
+ * 不认识的key（KNOWN_OPTIONS之外，例如拼错的--stpes）、枚举参数不在可选值里、整数参数有多余字符或不是正数，
+   都打印原因和用法后以1退出，不会悄悄退回默认值；检查的是合并之后的环境变量，直接设置的HW04_*同样适用
+ * 新增的参数：--num（同位置参数N）、--steps、--G、--eps；--dt（HW04_DT）现在是基本步长，
+   欧拉积分也直接用融合的step核，没有给--steps时总模拟时间不变，步数按步长换算
+ * G、eps、dt从constexpr变成启动时设置一次的全局变量：SIMD核在入口把它们广播到寄存器，循环里没有额外开销；
+   N固定的特化(step_fixed<N>)在参数等于默认值时仍用编译期常量，结果与原来逐位相同，参数不同时退回运行时版本
+*/
+const char *const USAGE =
+    "usage: %s [N] [--config=FILE] [--key=value ...] [--bench | --validate]\n"
+    "  --num=N --steps=K --G=g --eps=e --dt=h\n"
+    "  --isa=scalar|sse|avx2|avx512 --force=MODE --precision=float|double|compensated\n"
+    "  --integrator=euler|leapfrog|yoshida4|block --threads=T --cutoff=R (required by --force=cutoff)\n"
+    "  other --key=value options set HW04_KEY (e.g. --reorder=100, --snapshot=FILE)\n";
+
+/**
+ * @brief 程序读取的全部HW04_*参数，命令行和配置文件只接受这些key
+ */
+const char *const KNOWN_OPTIONS[] = {
+    "HW04_NUM", "HW04_STEPS", "HW04_G", "HW04_EPS", "HW04_DT",
+    "HW04_ISA", "HW04_FORCE", "HW04_PRECISION", "HW04_INTEGRATOR",
+    "HW04_THREADS", "HW04_SPIN", "HW04_DEVICE",
+    "HW04_INIT", "HW04_SEED",
+    "HW04_BLOCK_ETA", "HW04_CUTOFF", "HW04_SKIN", "HW04_THETA", "HW04_FMM_ORDER", "HW04_FMM_SAMPLES",
+    "HW04_PERF_FP_RAW", "HW04_ENERGY_EVERY", "HW04_ENSEMBLE", "HW04_REORDER", "HW04_OUTPUTS",
+    "HW04_RESTART", "HW04_CHECKPOINT", "HW04_CHECKPOINT_EVERY", "HW04_CHECKPOINT_VERIFY",
+    "HW04_SNAPSHOT", "HW04_SNAPSHOT_EVERY",
+    "HW04_ANALYSIS", "HW04_ANALYSIS_EVERY", "HW04_ANALYSIS_DEPTH", "HW04_ANALYSIS_THREADS",
+    "HW04_REALTIME", "HW04_REALTIME_PACE", "HW04_REALTIME_RING", "HW04_REALTIME_POLL",
+    "HW04_BENCH_N", "HW04_BENCH_TRIALS", "HW04_BENCH_FORMAT",
+    "HW04_VALIDATE_N", "HW04_VALIDATE_SEEDS", "HW04_VALIDATE_STEPS", "HW04_VALIDATE_SLACK",
+};
+
+/**
+ * @brief 把key（如"snapshot-every"）写成环境变量名HW04_SNAPSHOT_EVERY
+ */
+std::string option_name(std::string const &key) {
+  std::string name = "HW04_";
+  for (char c : key)
+    name += c == '-' ? '_' : (char)std::toupper((unsigned char)c);
+  return name;
+}
+
+bool known_option(std::string const &key) {
+  const std::string name = option_name(key);
+  for (const char *known : KNOWN_OPTIONS)
+    if (name == known)
+      return true;
+  return false;
+}
+
+/**
+ * @brief 写HW04_KEY，覆盖环境中已有的值
+ */
+void set_option(std::string const &key, std::string const &value) {
+  setenv(option_name(key).c_str(), value.c_str(), 1);
+}
+
+std::string trim(std::string const &s) {
+  const char *space = " \t\r\n";
+  std::size_t b = s.find_first_not_of(space);
+  return b == std::string::npos ? std::string() : s.substr(b, s.find_last_not_of(space) - b + 1);
+}
+
+bool load_config(const char *path) {
+  FILE *f = std::fopen(path, "r");
+  if (!f) {
+    std::fprintf(stderr, "config: cannot open %s: %s\n", path, std::strerror(errno));
+    return false;
+  }
+  bool ok = true;
+  char buf[1024];
+  for (int line = 1; std::fgets(buf, sizeof buf, f); line++) {
+    std::string s(buf);
+    s = trim(s.substr(0, s.find('#')));
+    if (s.empty())
+      continue;
+    std::size_t eq = s.find('=');
+    std::string key = eq == std::string::npos ? std::string() : trim(s.substr(0, eq));
+    if (key.empty()) {
+      std::fprintf(stderr, "config: %s:%d: expected key = value\n", path, line);
+      ok = false;
+      continue;
+    }
+    if (!known_option(key)) {
+      std::fprintf(stderr, "config: %s:%d: unknown key %s\n", path, line, key.c_str());
+      ok = false;
+      continue;
+    }
+    set_option(key, trim(s.substr(eq + 1)));
+  }
+  std::fclose(f);
+  return ok;
+}
+
+/**
+ * @brief 解析命令行：选项写进环境，返回--bench/--validate之类的命令（没有时为空串），出错时返回nullptr
+ */
+const char *parse_command_line(int argc, char **argv) {
+  const char *command = "";
+  std::string config;
+  std::vector<std::pair<std::string, std::string>> options;
+  for (int k = 1; k < argc; k++) {
+    std::string arg = argv[k];
+    if (arg == "--bench" || arg == "--validate") {
+      command = argv[k];
+    } else if (arg == "-h" || arg == "--help") {
+      printf(USAGE, argv[0]);
+      std::exit(0);
+    } else if (arg.compare(0, 2, "--") == 0 && arg.size() > 2) {
+      std::size_t eq = arg.find('=');
+      std::string key = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+      std::string value = eq == std::string::npos ? "1" : arg.substr(eq + 1);
+      if (key == "config") {
+        // 必须是--config=文件；裸的--config或空文件名都是用法错误
+        if (eq == std::string::npos || value.empty()) {
+          std::fprintf(stderr, USAGE, argv[0]);
+          return nullptr;
+        }
+        config = value;
+      } else if (known_option(key)) {
+        options.emplace_back(key, value);
+      } else {
+        std::fprintf(stderr, "unknown option --%s\n", key.c_str());
+        std::fprintf(stderr, USAGE, argv[0]);
+        return nullptr;
+      }
+    } else if (std::strtoul(argv[k], nullptr, 10) > 0) {
+      options.emplace_back("num", arg);
+    } else {
+      std::fprintf(stderr, USAGE, argv[0]);
+      return nullptr;
+    }
+  }
+  if (!config.empty() && !load_config(config.c_str()))
+    return nullptr;
+  for (auto const &o : options)
+    set_option(o.first, o.second);
+  return command;
+}
+
+/**
+ * @brief 把整个字符串解析成整数：没有数字、有多余字符或溢出时返回false
+ */
+bool parse_long(const char *s, long &out) {
+  char *end = nullptr;
+  errno = 0;
+  long v = std::strtol(s, &end, 10);
+  if (end == s || *end != '\0' || errno == ERANGE)
+    return false;
+  out = v;
+  return true;
+}
+
+/**
+ * @brief 把整个字符串解析成浮点数：没有数字、有多余字符、溢出或不是有限值时返回false
+ */
+bool parse_float(const char *s, float &out) {
+  char *end = nullptr;
+  errno = 0;
+  float v = std::strtof(s, &end);
+  // -ffast-math下std::isfinite会被折叠成true，直接看指数位是否全1来排除inf/nan
+  std::uint32_t bits;
+  std::memcpy(&bits, &v, sizeof bits);
+  if (end == s || *end != '\0' || errno == ERANGE || (bits & 0x7f800000u) == 0x7f800000u)
+    return false;
+  out = v;
+  return true;
+}
+
+/**
+ * @brief 从HW04_G / HW04_EPS / HW04_DT设置运行参数，值不是正数时报错
+ */
+bool load_params() {
+  float *params[] = {&G, &eps, &dt};
+  const char *names[] = {"HW04_G", "HW04_EPS", "HW04_DT"};
+  for (int k = 0; k < 3; k++)
+    if (const char *env = std::getenv(names[k])) {
+      float v;
+      if (!parse_float(env, v) || v <= 0.0f) {
+        std::fprintf(stderr, "%s=%s: expected a positive number\n", names[k], env);
+        return false;
+      }
+      *params[k] = v;
+    }
+  eps_sqr = eps * eps;
+  G_dt = G * dt;
+  return true;
+}
+
+/**
+ * @brief 环境变量name（设置了的话）必须是to_name(values[k])之一
+ */
+template <class E, std::size_t K>
+bool check_choice(const char *name, E const (&values)[K], const char *(*to_name)(E)) {
+  const char *env = std::getenv(name);
+  if (!env)
+    return true;
+  for (E v : values)
+    if (std::strcmp(env, to_name(v)) == 0)
+      return true;
+  std::fprintf(stderr, "%s=%s: expected ", name, env);
+  for (std::size_t k = 0; k < K; k++)
+    std::fprintf(stderr, "%s%s", k ? "|" : "", to_name(values[k]));
+  std::fprintf(stderr, "\n");
+  return false;
+}
+
+/**
+ * @brief 检查枚举参数的取值和数值参数的格式，出错时给出原因并返回false
+ *
+ * detect_*()本身遇到不认识的值仍退回默认值，main在调用它们之前先调用这里。
+ */
+bool check_options() {
+  const Isa isas[] = {Isa::Scalar, Isa::SSE, Isa::AVX2, Isa::AVX512};
+  const ForceMode modes[] = {ForceMode::Full, ForceMode::Symmetric,  ForceMode::Tree,
+                             ForceMode::Fmm,  ForceMode::Compressed, ForceMode::Cutoff};
+  const Precision precisions[] = {Precision::Float, Precision::Double, Precision::Compensated};
+  const Integrator integrators[] = {Integrator::Euler, Integrator::Leapfrog, Integrator::Yoshida4,
+                                    Integrator::Block};
+  const InitKind inits[] = {InitKind::Rand, InitKind::Uniform, InitKind::Cube, InitKind::Plummer};
+  bool ok = check_choice("HW04_ISA", isas, isa_name);
+  ok &= check_choice("HW04_FORCE", modes, force_mode_name);
+  ok &= check_choice("HW04_PRECISION", precisions, precision_name);
+  ok &= check_choice("HW04_INTEGRATOR", integrators, integrator_name);
+  ok &= check_choice("HW04_INIT", inits, init_kind_name);
+  if (const char *env = std::getenv("HW04_FORCE"))
+    if (std::strcmp(env, force_mode_name(ForceMode::Cutoff)) == 0 && !std::getenv("HW04_CUTOFF")) {
+      std::fprintf(stderr, "HW04_FORCE=cutoff needs HW04_CUTOFF=r_c\n");
+      ok = false;
+    }
+  // 数量必须是正数；间隔类参数0表示关闭，只要求非负
+  const char *positive[] = {"HW04_NUM",           "HW04_STEPS",         "HW04_THREADS",
+                            "HW04_ENSEMBLE",      "HW04_FMM_SAMPLES",   "HW04_ANALYSIS_DEPTH",
+                            "HW04_ANALYSIS_THREADS", "HW04_REALTIME_RING", "HW04_REALTIME_POLL",
+                            "HW04_BENCH_TRIALS",  "HW04_VALIDATE_STEPS"};
+  const char *non_negative[] = {"HW04_SEED",           "HW04_ENERGY_EVERY",   "HW04_REORDER",
+                                "HW04_CHECKPOINT_EVERY", "HW04_SNAPSHOT_EVERY", "HW04_ANALYSIS_EVERY"};
+  for (const char *name : positive)
+    if (const char *env = std::getenv(name)) {
+      long v;
+      if (!parse_long(env, v) || v <= 0) {
+        std::fprintf(stderr, "%s=%s: expected a positive integer\n", name, env);
+        ok = false;
+      }
+    }
+  for (const char *name : non_negative)
+    if (const char *env = std::getenv(name)) {
+      long v;
+      if (!parse_long(env, v) || v < 0) {
+        std::fprintf(stderr, "%s=%s: expected a non-negative integer\n", name, env);
+        ok = false;
+      }
+    }
+  if (const char *env = std::getenv("HW04_FMM_ORDER")) {
+    long v;
+    if (!parse_long(env, v) || v < 1 || v > FMM_MAX_ORDER) {
+      std::fprintf(stderr, "HW04_FMM_ORDER=%s: expected an integer in 1..%d\n", env, FMM_MAX_ORDER);
+      ok = false;
+    }
+  }
+  // 浮点参数同样整串解析：θ=0退化为直接求和、skin=0每步重建，都合法
+  const char *positive_float[] = {"HW04_BLOCK_ETA", "HW04_CUTOFF", "HW04_REALTIME",
+                                  "HW04_VALIDATE_SLACK"};
+  const char *non_negative_float[] = {"HW04_THETA", "HW04_SKIN"};
+  for (const char *name : positive_float)
+    if (const char *env = std::getenv(name)) {
+      float v;
+      if (!parse_float(env, v) || v <= 0.0f) {
+        std::fprintf(stderr, "%s=%s: expected a positive number\n", name, env);
+        ok = false;
+      }
+    }
+  for (const char *name : non_negative_float)
+    if (const char *env = std::getenv(name)) {
+      float v;
+      if (!parse_float(env, v) || v < 0.0f) {
+        std::fprintf(stderr, "%s=%s: expected a non-negative number\n", name, env);
+        ok = false;
+      }
+    }
+  return ok;
+}
+
+/**
+ * @brief 步数：HW04_STEPS（已由check_options检查），默认保持总模拟时间NUM_STEPS * defaults::dt不变
+ */
+long detect_steps(float h) {
+  if (const char *env = std::getenv("HW04_STEPS"))
+    return std::strtol(env, nullptr, 10);
+  return h == defaults::dt ? NUM_STEPS : std::lround((double)NUM_STEPS * defaults::dt / h);
+}
+
+
+/*
+✅ 已应用的main函数优化技术：
+
+1. 函数内联优化：
+ * 编译器能看到step()的完整实现
+ * 在高优化级别下自动内联，消除函数调用开销
+ * 但step()函数复杂，最终内联取决于编译器决策
+
+2. Lambda表达式优化：
+ * 使用benchmark模板函数和lambda表达式
+ * 避免函数指针开销，提高内联可能性
+ * 编译器能更好地优化循环结构
+
+3. 循环分块(blocking)在引力核里，不在main的循环里：
+ * SIMD的step核调用force_tiled_impl，j方向按L1分块(TileConfig::j_tile)，i方向按L2分块(TileConfig::i_chunk)，
+   每次同时算IB个i
+ * 块大小由tile_config()按运行时检测到的缓存大小确定；N=48时只有一块，等价于寄存器分块的直接求和
+ * main的时间步循环每步只调用一次step，没有可分块的数据访问
+
+🚫 未应用的优化（测试后无效或不适用）：
+
+❌ __attribute__((hot))：
+ * 现代编译器已能自动识别热点函数
+ * 手动标记可能不如编译器的静态分析准确
+
+❌ 默认启用Profile-guided optimization(PGO)：
+ * 需要额外的编译流程和训练数据，现在作为可选的构建配置提供（HW04_PGO，见CMakeLists.txt）
+ * 对于固定规模的N体问题，热点就是SIMD核本身，实测48体的用时在噪声范围内
+
+❌ 其他编译器特定指令：
+ * -ffast-math和-march=native已足够
+ * 过度优化可能降低可移植性
+*/
+int main(int argc, char **argv) {
+  const char *command = parse_command_line(argc, argv);
+  if (!command)
+    return 1;
+  if (!load_params() || !check_options()) {
+    std::fprintf(stderr, USAGE, argv[0]);
+    return 1;
+  }
+  if (std::strcmp(command, "--bench") == 0)
+    return bench_suite();
+  if (std::strcmp(command, "--validate") == 0)
+    return validate_suite();
+  // 星体数量（位置参数N或--num），默认与作业一致为48
+  std::size_t n = DEFAULT_NUM;
+  if (const char *env = std::getenv("HW04_NUM"))
+    n = std::strtoul(env, nullptr, 10);
+  Isa isa = detect_isa();
+  ForceMode mode = detect_force_mode();
+  Precision prec = detect_precision();
+  StepFn step_fn = select_step(isa, mode, prec);
+  StepEnergyFn step_energy_fn = select_step_with_energy(isa, mode, prec);
+  KickFn kick_fn = select_kick(isa, mode, prec);
+  EnergyFn energy_fn = select_calc(prec);
+#ifdef HW04_MT
+  mt_kernels = select_range_kernels(isa, prec);
+  energy_fn = select_calc_mt(prec);
+  if (mode == ForceMode::Full) {
+    step_fn = step_mt;
+    step_energy_fn = step_mt_with_energy;
+    kick_fn = kick_mt;
+  } else if (mode == ForceMode::Tree) {
+    step_fn = step_tree_mt;
+    kick_fn = kick_tree_mt;
+    step_energy_fn = prec == Precision::Double        ? step_tree_mt_with_energy<Precision::Double>
+                     : prec == Precision::Compensated ? step_tree_mt_with_energy<Precision::Compensated>
+                                                      : step_tree_mt_with_energy<Precision::Float>;
+  }
+  printf("Threads: %u\n", thread_pool().size());
+#endif
+  if (mode == ForceMode::Cutoff)
+    energy_fn = cutoff_energy;
+  // HW04_ENERGY_EVERY=K：每K步用融合能量的step输出一次能量，用于监控能量漂移
+  long energy_every = 0;
+  if (const char *env = std::getenv("HW04_ENERGY_EVERY"))
+    energy_every = std::strtol(env, nullptr, 10);
+#ifdef HW04_MPI
+  // main_mpi：整个程序交给run_mpi，只支持直接求和
+  if (mode != ForceMode::Full) {
+    std::fprintf(stderr, "main_mpi only supports HW04_FORCE=full\n");
+    return 1;
+  }
+  MPI_Init(&argc, &argv);
+  int rc = run_mpi(n, isa, detect_steps(dt), energy_every);
+  MPI_Finalize();
+  return rc;
+#endif
+  // HW04_ENSEMBLE=M：同时模拟M个互相独立的n体系统
+  if (const char *env = std::getenv("HW04_ENSEMBLE")) {
+    std::size_t systems = std::strtoul(env, nullptr, 10);
+    if (systems > 0) {
+      Ensemble ens(n, systems);
+      init(ens);
+      printf("Kernel: %s (ensemble)\n", isa_name(isa));
+      long ms = run_ensemble(ens, detect_steps(dt), isa);
+      printf("Time elapsed: %ld ms\n", ms);
+      return 0;
+    }
+  }
+  // HW04_INTEGRATOR / HW04_DT：换积分器或步长时总模拟时间不变，步数按步长换算，HW04_STEPS直接指定
+  // 欧拉积分在任意步长下都走融合的step核，只有其他积分器才需要integrate_fn
+  // 块时间步的h是它的大步，见BLOCK_COARSE
+  Integrator integ = detect_integrator();
+  const float h = integ == Integrator::Block ? dt * (float)(1 << BLOCK_COARSE) : dt;
+  const bool integrated = integ != Integrator::Euler;
+  const long steps = detect_steps(h);
+  IntegratorFn integrate_fn = select_integrator(isa, integ);
+  if (integ == Integrator::Block)
+    block_state().reset();
+  // 块时间步的活跃星体核只有直接求和
+  if (integ == Integrator::Block && mode != ForceMode::Full) {
+    std::fprintf(stderr, "HW04_INTEGRATOR=block only supports HW04_FORCE=full\n");
+    return 1;
+  }
+  // HW04_REORDER=K：每K步按Morton顺序重排星体
+  long reorder_every = 0;
+  if (const char *env = std::getenv("HW04_REORDER"))
+    reorder_every = integ == Integrator::Block ? 0 : std::strtol(env, nullptr, 10);
+  // HW04_RESTART=文件名：从检查点继续，代替init()
+  long first = 0;
+  std::unique_ptr<Stars> restored;
+  if (const char *path = std::getenv("HW04_RESTART")) {
+    const char *verify = std::getenv("HW04_CHECKPOINT_VERIFY");
+    float saved_h = h;
+    std::int64_t t0 = now_ns();
+    restored = load_checkpoint(path, &first, &saved_h, !verify || std::strcmp(verify, "0") != 0);
+    if (!restored)
+      return 1;
+    if (saved_h != h) {
+      std::fprintf(stderr, "restart: %s was written with dt = %g\n", path, saved_h);
+      return 1;
+    }
+    n = restored->n;
+    printf("Restart: step %ld from %s (%.3f ms)\n", first, path, (double)(now_ns() - t0) * 1e-6);
+  }
+  // HW04_INIT / HW04_SEED：初始条件，默认与作业相同的init()
+  const InitKind init_kind = detect_init_kind();
+  std::uint64_t seed = 1;
+  if (const char *env = std::getenv("HW04_SEED"))
+    seed = std::strtoull(env, nullptr, 10);
+  Stars stars = restored ? std::move(*restored) : Stars(n);
+  if (!restored && init_kind == InitKind::Rand)
+    init(stars);
+  else if (!restored) {
+    std::int64_t t0 = now_ns();
+    init(stars, init_kind, seed);
+    printf("Init: %s, seed %llu (%.3f ms)\n", init_kind_name(init_kind), (unsigned long long)seed,
+           (double)(now_ns() - t0) * 1e-6);
+  }
+  if (mode == ForceMode::Cutoff)
+    neighbor_list().configure(stars, h);
+  BodyOrder order(n);
+  // HW04_CHECKPOINT=文件名：每HW04_CHECKPOINT_EVERY步（默认10000）写一个检查点
+  const char *checkpoint = std::getenv("HW04_CHECKPOINT");
+  long checkpoint_every = 10000;
+  if (const char *env = std::getenv("HW04_CHECKPOINT_EVERY"))
+    checkpoint_every = std::strtol(env, nullptr, 10);
+  // HW04_SNAPSHOT=文件名：每HW04_SNAPSHOT_EVERY步（默认1000）写一帧快照
+  std::unique_ptr<SnapshotWriter> snapshot;
+  long snapshot_every = 1000;
+  if (const char *env = std::getenv("HW04_SNAPSHOT_EVERY"))
+    snapshot_every = std::strtol(env, nullptr, 10);
+  if (const char *path = std::getenv("HW04_SNAPSHOT")) {
+    snapshot.reset(new SnapshotWriter(path, n, h));
+    if (!snapshot->ok())
+      return 1;
+  }
+  BetweenSteps between{&order,     reorder_every,    snapshot.get(), snapshot_every,
+                       h,          checkpoint,       checkpoint_every, first};
+  // HW04_ANALYSIS_EVERY=K：每K步把一份快照交给分析线程池，HW04_ANALYSIS=文件名时写CSV
+  std::unique_ptr<Analyzer> analysis;
+  if (const char *env = std::getenv("HW04_ANALYSIS_EVERY")) {
+    std::size_t depth = 4;
+    unsigned threads = 2;
+    if (const char *d = std::getenv("HW04_ANALYSIS_DEPTH"))
+      depth = std::strtoul(d, nullptr, 10);
+    if (const char *t = std::getenv("HW04_ANALYSIS_THREADS"))
+      threads = (unsigned)std::strtoul(t, nullptr, 10);
+    between.analysis_every = std::strtol(env, nullptr, 10);
+    if (between.analysis_every > 0) {
+      analysis.reset(new Analyzer(n, depth, threads));
+      between.analysis = analysis.get();
+    }
+  }
+  // HW04_OUTPUTS=1：每步的加速度和最近邻写到force_output()，速度更新是单独的阶段
+  const char *outputs_env = std::getenv("HW04_OUTPUTS");
+  const bool outputs = outputs_env && std::strcmp(outputs_env, "0") != 0 &&
+                       mode == ForceMode::Full && prec == Precision::Float && !integrated;
+  ClosestApproach closest;
+  if (outputs) {
+    step_fn = select_output_step(isa);
+    step_energy_fn = select_output_step_with_energy(isa);
+  }
+  printf("Kernel: %s (%s, %s)\n", isa_name(isa), force_mode_name(mode), precision_name(prec));
+  if (integrated)
+    printf("Integrator: %s, dt = %g, %ld steps\n", integrator_name(integ), h, steps);
+  else if (!default_params() || steps != NUM_STEPS)
+    printf("Parameters: G = %g, eps = %g, dt = %g, %ld steps\n", G, eps, h, steps);
+  printf("Initial energy: %f\n", energy_fn(stars));
+  // FMM模式先在抽样星体上与直接求和比较一次，HW04_FMM_SAMPLES设置抽样数
+  if (mode == ForceMode::Fmm) {
+    std::size_t samples = 256;
+    if (const char *env = std::getenv("HW04_FMM_SAMPLES"))
+      samples = std::strtoul(env, nullptr, 10);
+    FmmAccuracy acc = fmm_accuracy(stars, samples);
+    printf("FMM order %d: rms error %g, max error %g over %zu sampled stars\n", fmm().order,
+           acc.rms, acc.max, acc.samples);
+  }
+  // 压缩布局同样先报告一次精度，抽样数与FMM共用HW04_FMM_SAMPLES
+  if (mode == ForceMode::Compressed) {
+    std::size_t samples = 256;
+    if (const char *env = std::getenv("HW04_FMM_SAMPLES"))
+      samples = std::strtoul(env, nullptr, 10);
+    CompressedAccuracy acc = compressed_accuracy(stars, isa, samples);
+    printf("Compressed: rms error %g, max error %g (float: rms %g, max %g) over %zu sampled stars\n",
+           acc.rms, acc.max, acc.float_rms, acc.float_max, acc.samples);
+  }
+  // 单线程循环与软实时模式共用的一步
+  auto advance = [&](long i) {
+    if (integrated) {
+      if (energy_every > 0 && i % energy_every == 0)
+        printf("Step %ld energy: %f\n", i, energy_fn(stars));
+      integrate_fn(stars, h, kick_fn);
+    } else if (energy_every > 0 && i % energy_every == 0)
+      printf("Step %ld energy: %f\n", i, step_energy_fn(stars));
+    else
+      step_fn(stars);
+    if (outputs)
+      closest.update(force_output(stars.padded), n, order, i);
+  };
+  // HW04_REALTIME=每步预算（微秒）：逐步计时、锁定内存、把位置发布到环形缓冲区
+  std::unique_ptr<Realtime> realtime;
+  if (const char *env = std::getenv("HW04_REALTIME")) {
+    const char *pace = std::getenv("HW04_REALTIME_PACE");
+    std::size_t depth = 8;
+    long poll_us = 1000;
+    if (const char *d = std::getenv("HW04_REALTIME_RING"))
+      depth = std::strtoul(d, nullptr, 10);
+    if (const char *p = std::getenv("HW04_REALTIME_POLL"))
+      poll_us = std::strtol(p, nullptr, 10);
+    realtime.reset(new Realtime(n, std::strtod(env, nullptr), pace && std::strcmp(pace, "0") != 0,
+                                depth, poll_us));
+  }
+  auto dt = benchmark([&] {
+    if (realtime) {
+      realtime->run(stars, first, steps, between, reorder_every > 0 ? &order : nullptr, advance);
+      return;
+    }
+    // 这里可以优化，编译器能看到step()的实现，在高优化级别下可能会自动内联以消除函数调用开销，
+    // 但由于step()函数包含嵌套循环且较为复杂，最终是否内联取决于编译器的内联阈值和代码膨胀考量
+#ifdef HW04_MT
+    if (mode == ForceMode::Full && !integrated && !outputs) {
+      run_timesteps(stars, first, steps, energy_every, &between);
+      return;
+    }
+#endif
+#ifdef HW04_GPU
+    if (mode == ForceMode::Full && prec == Precision::Float && !integrated && !outputs &&
+        run_gpu(stars, first, steps, energy_every, between))
+      return;
+#endif
+    for (long i = first; i < steps; i++) {
+      if (between.due(i))
+        between.run(stars, i);
+      advance(i);
+    }
+  });
+  if (snapshot)
+    snapshot->capture(stars, steps, (double)steps * h, reorder_every > 0 ? &order : nullptr);
+  restore_order(stars, order);
+  printf("Final energy: %f\n", energy_fn(stars));
+  printf("Time elapsed: %ld ms\n", dt);
+  if (realtime)
+    realtime->report(stdout);
+  if (mode == ForceMode::Cutoff) {
+    NeighborList const &nl = neighbor_list();
+    const double neighbors = nl.builds ? nl.pairs / ((double)nl.builds * (double)n) : 0.0;
+    printf("Neighbor list: cutoff %g, skin %g, %ld builds over %ld force passes (rebuild ratio %.3f), "
+           "%.1f neighbors per star (energies are the shifted-force potential)\n",
+           nl.cutoff, nl.skin, nl.builds, nl.steps,
+           nl.steps ? (double)nl.builds / (double)nl.steps : 0.0, neighbors);
+    if (neighbors < 1.0)
+      std::fprintf(stderr, "warning: fewer than one neighbor per star on average, HW04_CUTOFF=%g "
+                           "is too small for this system\n", nl.cutoff);
+  }
+  if (outputs && closest.step >= 0)
+    printf("Closest approach: %g at step %ld (stars %u and %u)\n",
+           std::sqrt(std::max(0.0f, closest.d2 - eps_sqr)), closest.step, closest.a, closest.b);
+  if (analysis) {
+    analysis->finish();
+    std::vector<AnalysisResult> const &res = analysis->results();
+    printf("Analysis: %zu frames, %ld dropped, max %zu in flight, latency mean %.3f ms max %.3f ms\n",
+           res.size(), analysis->dropped(), analysis->max_in_flight(), analysis->mean_latency_ms(),
+           analysis->max_latency_ms());
+    if (!res.empty())
+      printf("Analysis step %ld: energy %f, momentum (%g, %g, %g)\n", res.back().step,
+             res.back().energy, res.back().momentum[0], res.back().momentum[1],
+             res.back().momentum[2]);
+    if (const char *path = std::getenv("HW04_ANALYSIS"))
+      analysis->write_csv(path);
+  }
+  if (snapshot)
+    printf("Snapshots: %llu frames (%ld stalls)\n", (unsigned long long)snapshot->frames(),
+           snapshot->stalls());
+  if (integ == Integrator::Block) {
+    BlockState const &st = block_state();
+    printf("Block timesteps: %ld substeps, %.3f of bodies active per substep\n", st.substeps,
+           st.substeps ? (double)st.updates / ((double)st.substeps * (double)n) : 0.0);
+  }
+#ifdef HW04_PERF
+  perf_report(stdout, perf_counters().totals);
+#endif
   return 0;
 }